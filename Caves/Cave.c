@@ -23,106 +23,1312 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../Tools/perf_counters.h"
 
 #define TILE_FLOOR 0
 #define TILE_WALL 1
 
+#define R1_CELLS 9
+#define R2_CELLS 21
+
+/*
+ * A stage of generation. Every stage has a rule table: next[w][r1][r2] is
+ * the new tile for a cell that's wall (w=1) or floor (w=0) with r1 walls in
+ * the 3x3 around it and r2 in the 5x5 less its corners. The kernel that
+ * runs it is picked by the table's shape: rules of the classic form
+ * "R1 >= r1_cutoff || R2 <= r2_cutoff" keep their cutoffs, and rules that
+ * don't look at R2 don't count it.
+ */
+enum { KERNEL_THRESHOLD, KERNEL_R1, KERNEL_TABLE };
+
 typedef struct {
 	int r1_cutoff, r2_cutoff;
 	int reps;
+	int kernel;
+	const char *rule;   // As given, for rules that aren't thresholds
+	unsigned char next[2][R1_CELLS+1][R2_CELLS+1];
 } generation_params;
 
-int **grid;
-int **grid2;
+/*
+ * The grids, the current stage and the random number state are per thread,
+ * so that -candidates can generate several maps at once.
+ */
+__thread int **grid;
+__thread int **grid2;
+__thread unsigned rng_state;
 
 int fillprob = 40;
 int r1_cutoff = 5, r2_cutoff = 2;
 int size_x = 64, size_y = 20;
-generation_params *params;
+__thread generation_params *params;
 
 generation_params *params_set;
 int generations;
 
+/*
+ * Pinned cells. If a mask is loaded, every cell is written as
+ * (value & pin_keep) | pin_set, so a pinned cell has pin_keep 0 and pin_set
+ * holding its tile, and a free cell has pin_keep ~0 and pin_set 0. That
+ * needs no branches, so constrained generation costs the same as
+ * unconstrained.
+ */
+int **pin_keep;
+int **pin_set;
+
 int randpick(void)
 {
-	if(rand()%100 < fillprob)
+	if(rand_r(&rng_state)%100 < fillprob)
 		return TILE_WALL;
 	else
 		return TILE_FLOOR;
 }
 
-void initmap(void)
+/*
+ * A grid is one block of cells with a table of row pointers into it. Blocks
+ * of 2MB or more are aligned to 2MB and marked for transparent huge pages,
+ * so sweeping a 16k x 16k map takes a few hundred TLB entries rather than a
+ * quarter of a million. huge_pages is only cleared by -pagebench, to
+ * compare.
+ */
+#define HUGE_PAGE (2<<20)
+
+int huge_pages = 1;
+
+int **newgrid(void)
 {
-	int xi, yi;
+	int yi;
+	int **ret = (int**)malloc(sizeof(int*) * size_y);
+	size_t bytes = sizeof(int) * (size_t)size_x * size_y;
+	void *block = NULL;
 	
-	grid  = (int**)malloc(sizeof(int*) * size_y);
-	grid2 = (int**)malloc(sizeof(int*) * size_y);
+	if(bytes >= HUGE_PAGE) {
+		bytes = (bytes + HUGE_PAGE-1) / HUGE_PAGE * HUGE_PAGE;
+		if(!posix_memalign(&block, HUGE_PAGE, bytes))
+			madvise(block, bytes, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	} else
+		block = malloc(bytes);
 	
 	for(yi=0; yi<size_y; yi++)
+		ret[yi] = (int*)block + (size_t)yi * size_x;
+	return ret;
+}
+
+void freegrid(int **g)
+{
+	free(g[0]);
+	free(g);
+}
+
+typedef struct {
+	int **g, **g2;
+	int first_row, last_row;
+} touch_band;
+
+void *wall_band(void *arg)
+{
+	touch_band *band = (touch_band*)arg;
+	int xi, yi;
+	
+	for(yi=band->first_row; yi<band->last_row; yi++)
+	for(xi=0; xi<size_x; xi++)
+		band->g[yi][xi] = band->g2[yi][xi] = TILE_WALL;
+	return NULL;
+}
+
+/*
+ * Allocate grid and grid2 and fill both with wall, using up to #max_bands
+ * threads (0 for one per CPU), each taking a band of rows. A page is placed
+ * on the NUMA node of the thread that first writes it, and the generation
+ * kernels sweep the whole map on one thread, so everything but -pagebench
+ * passes 1 and the grids stay with the thread that generates them; the
+ * banded fill is only there for -pagebench to compare against.
+ */
+void wallgrids(int max_bands)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_bands = max_bands > 0 ? max_bands : (cpus > 0 ? cpus : 1);
+	touch_band bands[64];
+	pthread_t threads[64];
+	int ii;
+	
+	// Not worth a thread for less than 64 rows each
+	if(num_bands > 64)
+		num_bands = 64;
+	if(num_bands > size_y/64)
+		num_bands = size_y/64 > 0 ? size_y/64 : 1;
+	
+	grid  = newgrid();
+	grid2 = newgrid();
+	for(ii=0; ii<num_bands; ii++)
 	{
-		grid [yi] = (int*)malloc(sizeof(int) * size_x);
-		grid2[yi] = (int*)malloc(sizeof(int) * size_x);
+		bands[ii].g = grid;
+		bands[ii].g2 = grid2;
+		bands[ii].first_row = (long)size_y * ii / num_bands;
+		bands[ii].last_row = (long)size_y * (ii+1) / num_bands;
+		if(ii > 0)
+			pthread_create(&threads[ii], NULL, wall_band, &bands[ii]);
 	}
+	wall_band(&bands[0]);
+	for(ii=1; ii<num_bands; ii++)
+		pthread_join(threads[ii], NULL);
+}
+
+void apply_pins(void)
+{
+	int xi, yi;
+	
+	if(!pin_keep)
+		return;
+	for(yi=0; yi<size_y; yi++)
+	for(xi=0; xi<size_x; xi++)
+		grid[yi][xi] = (grid[yi][xi] & pin_keep[yi][xi]) | pin_set[yi][xi];
+}
+
+// Fill the inside of the grid at random, in order, so a seed always gives
+// the same map however the grids were set up.
+void randomize(void)
+{
+	int xi, yi;
 	
 	for(yi=1; yi<size_y-1; yi++)
 	for(xi=1; xi<size_x-1; xi++)
 		grid[yi][xi] = randpick();
 	
+	apply_pins();
+}
+
+void initmap(int max_bands)
+{
+	wallgrids(max_bands);
+	randomize();
+}
+
+/*
+ * Load an ASCII map, as printed by this program or edited by hand, as the
+ * starting grid in place of initmap()'s random fill, and take the map size
+ * from it. The "W[0]" and "Repeat" lines printfunc() writes are skipped.
+ * The file is mapped, lines are found with memchr, and cells are translated
+ * through a character table: '.' is floor and anything else is wall,
+ * including the padding of lines shorter than the longest.
+ */
+const char *loaded_map;
+
+int load_map(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	const char *data, *pos, *end, *eol, *first;
+	int tile_of[256];
+	size_t len, width = 0, height = 0;
+	int xi, yi;
+	
+	if(fd < 0)
+		return 0;
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return 0;
+	}
+	data = (const char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return 0;
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+	end = data + st.st_size;
+	
+	for(first=data; first<end; first=eol+1)
+	{
+		if(!(end-first>=4 && !memcmp(first, "W[0]", 4)) && !(end-first>=6 && !memcmp(first, "Repeat", 6)))
+			break;
+		eol = (const char*)memchr(first, '\n', end-first);
+		if(!eol)
+			eol = end-1;
+	}
+	
+	// Measure, then translate
+	for(pos=first; pos<end; pos=eol+1)
+	{
+		eol = (const char*)memchr(pos, '\n', end-pos);
+		if(!eol)
+			eol = end;
+		len = eol-pos;
+		if(len>0 && pos[len-1]=='\r')
+			len--;
+		if(len > width)
+			width = len;
+		height++;
+	}
+	if(width < 3 || height < 3 || width > INT32_MAX || height > INT32_MAX) {
+		munmap((void*)data, st.st_size);
+		return 0;
+	}
+	size_x = width;
+	size_y = height;
+	
+	for(xi=0; xi<256; xi++)
+		tile_of[xi] = TILE_WALL;
+	tile_of['.'] = TILE_FLOOR;
+	
+	wallgrids(1);
+	for(pos=first, yi=0; yi<size_y; yi++, pos=eol+1)
+	{
+		eol = (const char*)memchr(pos, '\n', end-pos);
+		if(!eol)
+			eol = end;
+		for(xi=0; xi<eol-pos && xi<size_x; xi++)
+			grid[yi][xi] = tile_of[(unsigned char)pos[xi]];
+		for(; xi<size_x; xi++)
+			grid[yi][xi] = TILE_WALL;
+	}
+	munmap((void*)data, st.st_size);
+	loaded_map = filename;
+	return 1;
+}
+
+/*
+ * Load a pin mask: an ASCII map the same size as the one being generated,
+ * with '#' for a cell pinned to wall, '.' for a cell pinned to floor, and
+ * anything else for a free cell. Missing rows and columns are free.
+ */
+int load_pins(const char *filename)
+{
+	FILE *fin = fopen(filename, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	int xi, yi;
+	
+	if(!fin)
+		return 0;
+	
+	pin_keep = (int**)malloc(sizeof(int*) * size_y);
+	pin_set  = (int**)malloc(sizeof(int*) * size_y);
 	for(yi=0; yi<size_y; yi++)
-	for(xi=0; xi<size_x; xi++)
-		grid2[yi][xi] = TILE_WALL;
+	{
+		pin_keep[yi] = (int*)malloc(sizeof(int) * size_x);
+		pin_set [yi] = (int*)malloc(sizeof(int) * size_x);
+		
+		length = fin ? getline(&line, &line_size, fin) : -1;
+		if(length < 0 && fin) {
+			fclose(fin);
+			fin = NULL;
+		}
+		
+		for(xi=0; xi<size_x; xi++)
+		{
+			char c = xi<length ? line[xi] : ' ';
+			pin_keep[yi][xi] = (c=='#' || c=='.') ? 0 : ~0;
+			pin_set [yi][xi] = c=='#' ? TILE_WALL : TILE_FLOOR;
+		}
+	}
+	if(fin)
+		fclose(fin);
+	free(line);
+	return 1;
+}
+
+/*
+ * Rule strings. A stage can be given as a rule instead of an "r1 r2 count"
+ * triple:
+ *
+ *     [B:]expr[/S:expr][xcount]
+ *
+ * where expr is a condition on R1 and R2 built from comparisons (R1>=5,
+ * R2<=2, R1=3, R2!=0, R1<4, R2>9), & (and), | (or) and parentheses; & binds
+ * tighter than |. The cell becomes wall if the condition holds. With a B:
+ * part and an S: part, B applies to floor cells and S to wall cells, as in
+ * "B:R1>=6/S:R1>=4x3". So "R1>=5|R2<=2x4" is the same as "5 2 4".
+ *
+ * The rule is evaluated for every possible (wall, R1, R2) once, when it's
+ * parsed, to fill in the stage's table; a syntax error is reported then.
+ */
+int eval_or(const char **p, int r1, int r2);
+
+int eval_atom(const char **p, int r1, int r2)
+{
+	int value, count, result;
+	char op[3] = {0};
+	
+	if(**p == '(') {
+		(*p)++;
+		result = eval_or(p, r1, r2);
+		if(result < 0 || **p != ')')
+			return -1;
+		(*p)++;
+		return result;
+	}
+	
+	if((*p)[0] != 'R' || ((*p)[1] != '1' && (*p)[1] != '2'))
+		return -1;
+	count = (*p)[1]=='1' ? r1 : r2;
+	*p += 2;
+	
+	if(!**p || !strchr("<>=!", **p))
+		return -1;
+	op[0] = *(*p)++;
+	if(**p == '=')
+		op[1] = *(*p)++;
+	if(!(**p >= '0' && **p <= '9'))
+		return -1;
+	value = strtol(*p, (char**)p, 10);
+	
+	if(!strcmp(op, ">=")) return count >= value;
+	if(!strcmp(op, "<=")) return count <= value;
+	if(!strcmp(op, ">"))  return count > value;
+	if(!strcmp(op, "<"))  return count < value;
+	if(!strcmp(op, "=") || !strcmp(op, "==")) return count == value;
+	if(!strcmp(op, "!=")) return count != value;
+	return -1;
+}
+
+int eval_and(const char **p, int r1, int r2)
+{
+	int result = eval_atom(p, r1, r2), rhs;
+	
+	while(result >= 0 && **p == '&') {
+		(*p)++;
+		rhs = eval_atom(p, r1, r2);
+		result = rhs < 0 ? -1 : (result && rhs);
+	}
+	return result;
+}
+
+int eval_or(const char **p, int r1, int r2)
+{
+	int result = eval_and(p, r1, r2), rhs;
+	
+	while(result >= 0 && **p == '|') {
+		(*p)++;
+		rhs = eval_and(p, r1, r2);
+		result = rhs < 0 ? -1 : (result || rhs);
+	}
+	return result;
+}
+
+// Fill in #stage from the rule string #rule. Returns 0 on a syntax error.
+int parse_rule(const char *rule, generation_params *stage)
+{
+	const char *parts[2];   // The conditions for floor and wall cells
+	const char *end, *repeat = strrchr(rule, 'x');
+	int wall, r1, r2, a, b;
+	
+	// A repeat count is all digits, and there has to be one after the x
+	if(repeat && (!repeat[1] || repeat[1+strspn(repeat+1, "0123456789")]))
+		return 0;
+	stage->rule = rule;
+	stage->reps = repeat ? atoi(repeat+1) : 1;
+	end = repeat ? repeat : rule + strlen(rule);
+	
+	if(!strncmp(rule, "B:", 2)) {
+		const char *survive = strstr(rule, "/S:");
+		if(!survive || survive > end)
+			return 0;
+		parts[0] = rule+2;
+		parts[1] = survive+3;
+	} else {
+		parts[0] = parts[1] = rule;
+	}
+	
+	for(wall=0; wall<2; wall++)
+	for(r1=0; r1<=R1_CELLS; r1++)
+	for(r2=0; r2<=R2_CELLS; r2++)
+	{
+		const char *p = parts[wall];
+		int result = eval_or(&p, r1, r2);
+		
+		// The condition has to run up to the next part or the repeat count
+		if(result < 0 || (p != end && !(wall==0 && parts[0]!=parts[1] && !strncmp(p, "/S:", 3))))
+			return 0;
+		stage->next[wall][r1][r2] = result ? TILE_WALL : TILE_FLOOR;
+	}
+	
+	// Look for a threshold rule that gives the same table
+	for(a=0; a<=R1_CELLS+1; a++)
+	for(b=-1; b<=R2_CELLS; b++)
+	{
+		int same = 1;
+		for(wall=0; wall<2 && same; wall++)
+		for(r1=0; r1<=R1_CELLS && same; r1++)
+		for(r2=0; r2<=R2_CELLS && same; r2++)
+			same = stage->next[wall][r1][r2] == (r1 >= a || r2 <= b);
+		if(same) {
+			stage->kernel = KERNEL_THRESHOLD;
+			stage->r1_cutoff = a;
+			stage->r2_cutoff = b;
+			return 1;
+		}
+	}
+	
+	// Otherwise, see whether it ever looks at R2
+	stage->kernel = KERNEL_R1;
+	for(wall=0; wall<2; wall++)
+	for(r1=0; r1<=R1_CELLS; r1++)
+	for(r2=1; r2<=R2_CELLS; r2++)
+		if(stage->next[wall][r1][r2] != stage->next[wall][r1][0])
+			stage->kernel = KERNEL_TABLE;
+	return 1;
+}
+
+// Fill in #stage from a "r1 r2 count" triple.
+void threshold_rule(int r1_cutoff, int r2_cutoff, int reps, generation_params *stage)
+{
+	int wall, r1, r2;
+	
+	stage->r1_cutoff = r1_cutoff;
+	stage->r2_cutoff = r2_cutoff;
+	stage->reps = reps;
+	stage->kernel = KERNEL_THRESHOLD;
+	stage->rule = NULL;
+	for(wall=0; wall<2; wall++)
+	for(r1=0; r1<=R1_CELLS; r1++)
+	for(r2=0; r2<=R2_CELLS; r2++)
+		stage->next[wall][r1][r2] = (r1 >= r1_cutoff || r2 <= r2_cutoff) ? TILE_WALL : TILE_FLOOR;
+}
+
+/*
+ * One generation, into grid2. Each kernel walks the map a row at a time,
+ * keeping the number of walls in each column over the 3 rows (col3) and 5
+ * rows (col5) around the current one, so R1 is three col3 entries and R2
+ * is three col5 entries plus the col3 entries two columns away. The column
+ * arrays have two zeroes of padding at each end, which count as floor, as
+ * do rows off the edge of the map.
+ */
+#define WALL_AT(y, x) ((y)>=0 && (y)<size_y && grid[y][x] != TILE_FLOOR)
+
+void column_sums(int yi, int *col3, int *col5)
+{
+	int xi;
+	
+	for(xi=0; xi<size_x; xi++) {
+		col3[xi] = WALL_AT(yi-1, xi) + WALL_AT(yi, xi) + WALL_AT(yi+1, xi);
+		col5[xi] = col3[xi] + WALL_AT(yi-2, xi) + WALL_AT(yi+2, xi);
+	}
+}
+
+void threshold_kernel(int *col3, int *col5)
+{
+	int xi, yi;
+	int r1_cutoff = params->r1_cutoff, r2_cutoff = params->r2_cutoff;
+	
+	for(yi=1; yi<size_y-1; yi++)
+	{
+		int *out = grid2[yi];
+		column_sums(yi, col3, col5);
+		for(xi=1; xi<size_x-1; xi++)
+		{
+			int r1 = col3[xi-1] + col3[xi] + col3[xi+1];
+			int r2 = col5[xi-1] + col5[xi] + col5[xi+1] + col3[xi-2] + col3[xi+2];
+			out[xi] = (r1 >= r1_cutoff) | (r2 <= r2_cutoff);
+		}
+	}
+}
+
+void r1_kernel(int *col3)
+{
+	int xi, yi;
+	
+	for(yi=1; yi<size_y-1; yi++)
+	{
+		const int *row = grid[yi];
+		int *out = grid2[yi];
+		
+		for(xi=0; xi<size_x; xi++)
+			col3[xi] = WALL_AT(yi-1, xi) + WALL_AT(yi, xi) + WALL_AT(yi+1, xi);
+		for(xi=1; xi<size_x-1; xi++)
+		{
+			int r1 = col3[xi-1] + col3[xi] + col3[xi+1];
+			out[xi] = params->next[row[xi] != TILE_FLOOR][r1][0];
+		}
+	}
+}
+
+void table_kernel(int *col3, int *col5)
+{
+	int xi, yi;
+	
+	for(yi=1; yi<size_y-1; yi++)
+	{
+		const int *row = grid[yi];
+		int *out = grid2[yi];
+		
+		column_sums(yi, col3, col5);
+		for(xi=1; xi<size_x-1; xi++)
+		{
+			int r1 = col3[xi-1] + col3[xi] + col3[xi+1];
+			int r2 = col5[xi-1] + col5[xi] + col5[xi+1] + col3[xi-2] + col3[xi+2];
+			out[xi] = params->next[row[xi] != TILE_FLOOR][r1][r2];
+		}
+	}
+}
+
+void generation(void)
+{
+	int xi, yi;
+	int *col3 = (int*)calloc(size_x+4, sizeof(int));
+	int *col5 = (int*)calloc(size_x+4, sizeof(int));
+	
+	switch(params->kernel) {
+		case KERNEL_THRESHOLD: threshold_kernel(col3+2, col5+2); break;
+		case KERNEL_R1:        r1_kernel(col3+2);                break;
+		default:               table_kernel(col3+2, col5+2);     break;
+	}
+	free(col3);
+	free(col5);
+	
+	if(pin_keep)
+	{
+		for(yi=1; yi<size_y-1; yi++)
+		for(xi=1; xi<size_x-1; xi++)
+			grid[yi][xi] = (grid2[yi][xi] & pin_keep[yi][xi]) | pin_set[yi][xi];
+	}
+	else
+	{
+		for(yi=1; yi<size_y-1; yi++)
+		for(xi=1; xi<size_x-1; xi++)
+			grid[yi][xi] = grid2[yi][xi];
+	}
+}
+
+void run_stages(int first, int last)
+{
+	int ii, jj;
+	
+	for(ii=first; ii<last; ii++)
+	{
+		params = &params_set[ii];
+		for(jj=0; jj<params->reps; jj++)
+			generation();
+	}
+}
+
+/*
+ * Multiresolution generation. The early stages decide the large-scale
+ * structure, so run them on a grid #factor times smaller in each direction,
+ * then scale it up, randomize the cells along the blocky edges this leaves,
+ * and run only the last #fine_stages stages at full resolution.
+ */
+void multigrid_generate(int factor, int fine_stages)
+{
+	int full_x = size_x, full_y = size_y;
+	int **coarse_keep = pin_keep;
+	int **coarse;
+	int xi, yi;
+	
+	if(fine_stages > generations)
+		fine_stages = generations;
+	
+	size_x = (full_x + factor-1) / factor;
+	size_y = (full_y + factor-1) / factor;
+	if(size_x < 3) size_x = 3;
+	if(size_y < 3) size_y = 3;
+	pin_keep = NULL;
+	
+	initmap(1);
+	run_stages(0, generations-fine_stages);
+	coarse = grid;
+	freegrid(grid2);
+	
+	size_x = full_x;
+	size_y = full_y;
+	pin_keep = coarse_keep;
+	wallgrids(1);
 	
 	for(yi=0; yi<size_y; yi++)
-		grid[yi][0] = grid[yi][size_x-1] = TILE_WALL;
 	for(xi=0; xi<size_x; xi++)
-		grid[0][xi] = grid[size_y-1][xi] = TILE_WALL;
+	{
+		int here = coarse[yi/factor][xi/factor];
+		
+		if(yi==0 || xi==0 || yi==size_y-1 || xi==size_x-1)
+			grid[yi][xi] = TILE_WALL;
+		else if(coarse[(yi-1)/factor][xi/factor] != here || coarse[(yi+1)/factor][xi/factor] != here
+		     || coarse[yi/factor][(xi-1)/factor] != here || coarse[yi/factor][(xi+1)/factor] != here)
+			grid[yi][xi] = rand_r(&rng_state)%2 ? TILE_WALL : TILE_FLOOR;
+		else
+			grid[yi][xi] = here;
+		
+		if(pin_keep)
+			grid[yi][xi] = (grid[yi][xi] & pin_keep[yi][xi]) | pin_set[yi][xi];
+	}
+	freegrid(coarse);
+	
+	run_stages(generations-fine_stages, generations);
 }
 
-void generation(void)
+/*
+ * Regional regeneration. Re-randomize the cells in columns x0..x1-1 and
+ * rows y0..y1-1 and run every stage on them alone, with the rest of the map
+ * as a fixed boundary. The stages run on a window of the grid reaching two
+ * cells past the rectangle on each side, as far as a cell's neighbourhood
+ * goes. The window's rows point into the full grid, and every cell in it
+ * outside the rectangle is pinned to its current value, so the cost is
+ * proportional to the rectangle, not the map.
+ */
+void regenerate_region(int x0, int y0, int x1, int y1)
 {
-	int xi, yi, ii, jj;
+	int full_x = size_x, full_y = size_y;
+	int **full_grid = grid, **full_grid2 = grid2;
+	int **full_keep = pin_keep, **full_set = pin_set;
+	int wx0 = x0-2 > 0 ? x0-2 : 0, wx1 = x1+2 < size_x ? x1+2 : size_x;
+	int wy0 = y0-2 > 0 ? y0-2 : 0, wy1 = y1+2 < size_y ? y1+2 : size_y;
+	int xi, yi, inside;
+	
+	size_x = wx1-wx0;
+	size_y = wy1-wy0;
+	grid  = (int**)malloc(sizeof(int*) * size_y);
+	grid2 = (int**)malloc(sizeof(int*) * size_y);
+	pin_keep = newgrid();
+	pin_set  = newgrid();
+	
+	for(yi=0; yi<size_y; yi++)
+	{
+		grid [yi] = full_grid [wy0+yi] + wx0;
+		grid2[yi] = full_grid2[wy0+yi] + wx0;
+		for(xi=0; xi<size_x; xi++)
+		{
+			inside = wx0+xi>=x0 && wx0+xi<x1 && wy0+yi>=y0 && wy0+yi<y1;
+			if(!inside) {
+				pin_keep[yi][xi] = 0;
+				pin_set [yi][xi] = grid[yi][xi];
+				continue;
+			}
+			pin_keep[yi][xi] = full_keep ? full_keep[wy0+yi][wx0+xi] : ~0;
+			pin_set [yi][xi] = full_set  ? full_set [wy0+yi][wx0+xi] : 0;
+			grid[yi][xi] = (randpick() & pin_keep[yi][xi]) | pin_set[yi][xi];
+		}
+	}
+	
+	run_stages(0, generations);
+	
+	freegrid(pin_keep);
+	freegrid(pin_set);
+	free(grid);
+	free(grid2);
+	grid = full_grid;
+	grid2 = full_grid2;
+	pin_keep = full_keep;
+	pin_set = full_set;
+	size_x = full_x;
+	size_y = full_y;
+}
+
+/*
+ * Statistics used to compare generation modes: the fraction of the inside
+ * of the map that's open, and the sizes of the 4-connected open areas.
+ * Component sizes are counted in power-of-two buckets: bucket n holds the
+ * components with between 2^n and 2^(n+1)-1 cells.
+ */
+#define STAT_BUCKETS 24
+
+typedef struct {
+	double open_ratio;
+	int components;
+	double largest_share;
+	int size_buckets[STAT_BUCKETS];
+} map_stats;
+
+void compute_stats(map_stats *stats)
+{
+	int xi, yi;
+	long open = 0, largest = 0;
+	int *stack = (int*)malloc(sizeof(int) * size_x * size_y);
+	char *seen = (char*)calloc(size_x * size_y, 1);
+	
+	memset(stats, 0, sizeof(*stats));
 	
 	for(yi=1; yi<size_y-1; yi++)
 	for(xi=1; xi<size_x-1; xi++)
 	{
-		int adjcount_r1 = 0,
-		    adjcount_r2 = 0;
+		long cells = 0;
+		int top = 0, bucket = 0;
+		
+		if(grid[yi][xi] != TILE_FLOOR || seen[yi*size_x + xi])
+			continue;
 		
-		for(ii=-1; ii<=1; ii++)
-		for(jj=-1; jj<=1; jj++)
+		seen[yi*size_x + xi] = 1;
+		stack[top++] = yi*size_x + xi;
+		while(top > 0)
 		{
-			if(grid[yi+ii][xi+jj] != TILE_FLOOR)
-				adjcount_r1++;
+			int pos = stack[--top];
+			int x = pos % size_x, y = pos / size_x;
+			cells++;
+			
+			#define VISIT(nx, ny) \
+				if(grid[ny][nx] == TILE_FLOOR && !seen[(ny)*size_x + (nx)]) { \
+					seen[(ny)*size_x + (nx)] = 1; \
+					stack[top++] = (ny)*size_x + (nx); \
+				}
+			VISIT(x-1, y);
+			VISIT(x+1, y);
+			VISIT(x, y-1);
+			VISIT(x, y+1);
+			#undef VISIT
 		}
-		for(ii=yi-2; ii<=yi+2; ii++)
-		for(jj=xi-2; jj<=xi+2; jj++)
+		
+		open += cells;
+		if(cells > largest)
+			largest = cells;
+		stats->components++;
+		while(bucket < STAT_BUCKETS-1 && cells >= (2L << bucket))
+			bucket++;
+		stats->size_buckets[bucket]++;
+	}
+	
+	stats->open_ratio = (double)open / ((double)(size_x-2) * (size_y-2));
+	stats->largest_share = open ? (double)largest / open : 0;
+	free(stack);
+	free(seen);
+}
+
+/*
+ * Map metrics for QA, written as JSON. The first pass counts floor and wall
+ * cells, per-row and per-column floor occupancy, and the bounding box of the
+ * floor. It's split into bands of rows counted on separate threads, and the
+ * inner loops are branch-free so the compiler can vectorize them. The second
+ * pass is compute_stats()'s flood fill, for the connected areas.
+ */
+typedef struct {
+	int **g;
+	int first_row, last_row;
+	long floor;
+	int *row_floor;   // Indexed by row, for this band's rows only
+	int *col_floor;   // This band's share of each column's count
+	int min_x, min_y, max_x, max_y;
+} metrics_band;
+
+void *count_band(void *arg)
+{
+	metrics_band *band = (metrics_band*)arg;
+	int xi, yi;
+	
+	band->floor = 0;
+	band->min_x = size_x; band->min_y = size_y;
+	band->max_x = band->max_y = -1;
+	for(yi=band->first_row; yi<band->last_row; yi++)
+	{
+		const int *row = band->g[yi];
+		int count = 0, first, last;
+		
+		for(xi=0; xi<size_x; xi++) {
+			int open = row[xi] == TILE_FLOOR;
+			count += open;
+			band->col_floor[xi] += open;
+		}
+		band->row_floor[yi] = count;
+		band->floor += count;
+		if(!count)
+			continue;
+		
+		for(xi=0; xi<size_x && row[xi] != TILE_FLOOR; xi++);
+		first = xi;
+		for(xi=size_x-1; xi>=0 && row[xi] != TILE_FLOOR; xi--);
+		last = xi;
+		if(first < band->min_x) band->min_x = first;
+		if(last > band->max_x) band->max_x = last;
+		if(yi < band->min_y) band->min_y = yi;
+		band->max_y = yi;
+	}
+	return NULL;
+}
+
+void write_int_array(FILE *fout, const char *name, const int *values, int count)
+{
+	int ii;
+	
+	fprintf(fout, "  \"%s\": [", name);
+	for(ii=0; ii<count; ii++)
+		fprintf(fout, ii ? ",%i" : "%i", values[ii]);
+	fprintf(fout, "]");
+}
+
+int write_metrics(const char *filename)
+{
+	FILE *fout = fopen(filename, "w");
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_bands = cpus > 0 ? cpus : 1;
+	int *row_floor, *col_floor;
+	pthread_t *threads;
+	metrics_band *bands;
+	map_stats stats;
+	long floor = 0, cells = (long)size_x * size_y;
+	int min_x = size_x, min_y = size_y, max_x = -1, max_y = -1;
+	int ii, xi;
+	
+	if(!fout)
+		return 0;
+	
+	// Not worth a thread for less than 64 rows each
+	if(num_bands > size_y/64)
+		num_bands = size_y/64 > 0 ? size_y/64 : 1;
+	
+	row_floor = (int*)calloc(size_y, sizeof(int));
+	col_floor = (int*)calloc((size_t)size_x * num_bands, sizeof(int));
+	threads = (pthread_t*)malloc(sizeof(pthread_t) * num_bands);
+	bands = (metrics_band*)malloc(sizeof(metrics_band) * num_bands);
+	
+	for(ii=0; ii<num_bands; ii++)
+	{
+		bands[ii].g = grid;
+		bands[ii].first_row = (long)size_y * ii / num_bands;
+		bands[ii].last_row = (long)size_y * (ii+1) / num_bands;
+		bands[ii].row_floor = row_floor;
+		bands[ii].col_floor = col_floor + (size_t)size_x * ii;
+		if(ii > 0)
+			pthread_create(&threads[ii], NULL, count_band, &bands[ii]);
+	}
+	count_band(&bands[0]);
+	
+	for(ii=0; ii<num_bands; ii++)
+	{
+		if(ii > 0)
+			pthread_join(threads[ii], NULL);
+		floor += bands[ii].floor;
+		if(bands[ii].max_y < 0)
+			continue;
+		if(bands[ii].min_x < min_x) min_x = bands[ii].min_x;
+		if(bands[ii].min_y < min_y) min_y = bands[ii].min_y;
+		if(bands[ii].max_x > max_x) max_x = bands[ii].max_x;
+		if(bands[ii].max_y > max_y) max_y = bands[ii].max_y;
+		if(ii > 0) {
+			for(xi=0; xi<size_x; xi++)
+				col_floor[xi] += bands[ii].col_floor[xi];
+		}
+	}
+	
+	compute_stats(&stats);
+	
+	fprintf(fout, "{\n");
+	fprintf(fout, "  \"width\": %i,\n  \"height\": %i,\n", size_x, size_y);
+	fprintf(fout, "  \"floor_fraction\": %.6f,\n", (double)floor / cells);
+	fprintf(fout, "  \"wall_fraction\": %.6f,\n", (double)(cells-floor) / cells);
+	fprintf(fout, "  \"components\": %i,\n", stats.components);
+	fprintf(fout, "  \"largest_component_share\": %.6f,\n", stats.largest_share);
+	if(max_y >= 0)
+		fprintf(fout, "  \"floor_bbox\": {\"x0\": %i, \"y0\": %i, \"x1\": %i, \"y1\": %i},\n",
+			min_x, min_y, max_x, max_y);
+	else
+		fprintf(fout, "  \"floor_bbox\": null,\n");
+	write_int_array(fout, "row_floor", row_floor, size_y);
+	fprintf(fout, ",\n");
+	write_int_array(fout, "column_floor", col_floor, size_x);
+	fprintf(fout, "\n}\n");
+	fclose(fout);
+	
+	free(row_floor);
+	free(col_floor);
+	free(threads);
+	free(bands);
+	return 1;
+}
+
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * Generate #runs maps at full resolution and #runs with multigrid_generate(),
+ * using the same seeds for both, and print the average time and statistics
+ * of each.
+ */
+void benchmark(int runs, unsigned seed, int factor, int fine_stages)
+{
+	int mode, run, ii;
+	double counter_totals[2][NUM_COUNTERS] = {{0}};
+	
+	open_counters();
+	printf("%-10s %10s %8s %11s %9s  component sizes (1, 2-3, 4-7, ...)\n",
+		"mode", "time(ms)", "open%", "components", "largest%");
+	for(mode=0; mode<2; mode++)
+	{
+		double total_time = 0, open = 0, largest = 0, components = 0;
+		double buckets[STAT_BUCKETS] = {0};
+		int used_buckets = 1;
+		
+		for(run=0; run<runs; run++)
 		{
-			if(abs(ii-yi)==2 && abs(jj-xi)==2)
-				continue;
-			if(ii<0 || jj<0 || ii>=size_y || jj>=size_x)
-				continue;
-			if(grid[ii][jj] != TILE_FLOOR)
-				adjcount_r2++;
+			map_stats stats;
+			double start;
+			uint64_t before[NUM_COUNTERS], after[NUM_COUNTERS];
+			
+			rng_state = seed + run;
+			read_counters(before);
+			start = now_seconds();
+			if(mode == 0) {
+				initmap(1);
+				run_stages(0, generations);
+			} else {
+				multigrid_generate(factor, fine_stages);
+			}
+			total_time += now_seconds() - start;
+			read_counters(after);
+			for(ii=0; ii<NUM_COUNTERS; ii++)
+				counter_totals[mode][ii] += after[ii] - before[ii];
+			
+			compute_stats(&stats);
+			open += stats.open_ratio;
+			largest += stats.largest_share;
+			components += stats.components;
+			for(ii=0; ii<STAT_BUCKETS; ii++) {
+				buckets[ii] += stats.size_buckets[ii];
+				if(stats.size_buckets[ii])
+					used_buckets = ii+1 > used_buckets ? ii+1 : used_buckets;
+			}
+			
+			freegrid(grid);
+			freegrid(grid2);
+		}
+		
+		printf("%-10s %10.2f %8.2f %11.1f %9.2f ", mode==0 ? "full" : "multigrid",
+			total_time*1000/runs, open*100/runs, components/runs, largest*100/runs);
+		for(ii=0; ii<used_buckets; ii++)
+			printf(" %.1f", buckets[ii]/runs);
+		putchar('\n');
+	}
+	
+	// Counters per cell of the map, per run
+	if(!counters_open) {
+		printf("\nHardware counters unavailable; times only.\n");
+		return;
+	}
+	printf("\n%-10s", "per cell");
+	for(ii=0; ii<NUM_COUNTERS; ii++)
+		printf(" %10s", counter_names[ii]);
+	printf(" %10s\n", "IPC");
+	for(mode=0; mode<2; mode++)
+	{
+		double cells = (double)size_x * size_y * runs;
+		printf("%-10s", mode==0 ? "full" : "multigrid");
+		for(ii=0; ii<NUM_COUNTERS; ii++) {
+			if(counter_slot[ii] >= 0)
+				printf(" %10.3f", counter_totals[mode][ii] / cells);
+			else
+				printf(" %10s", "n/a");
 		}
-		if(adjcount_r1 >= params->r1_cutoff || adjcount_r2 <= params->r2_cutoff)
-			grid2[yi][xi] = TILE_WALL;
+		if(counter_slot[0] >= 0 && counter_slot[1] >= 0 && counter_totals[mode][0] > 0)
+			printf(" %10.2f\n", counter_totals[mode][1] / counter_totals[mode][0]);
 		else
-			grid2[yi][xi] = TILE_FLOOR;
+			printf(" %10s\n", "n/a");
 	}
-	for(yi=1; yi<size_y-1; yi++)
-	for(xi=1; xi<size_x-1; xi++)
-		grid[yi][xi] = grid2[yi][xi];
+}
+
+/*
+ * -pagebench: generate #runs maps with each combination of small or huge
+ * pages and one or a band per CPU first touching the grids, using the same
+ * seeds for all, and print the time to set up the grids, as bandwidth since
+ * it's nothing but writes, and the time and dTLB and LLC misses per cell
+ * for running the stages.
+ */
+void page_benchmark(int runs, unsigned seed)
+{
+	FILE *fin = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	char thp[64] = "unknown";
+	double cells = (double)size_x * size_y * runs;
+	int mode, run, ii;
+	
+	if(fin) {
+		if(fgets(thp, sizeof(thp), fin))
+			thp[strcspn(thp, "\n")] = 0;
+		fclose(fin);
+	}
+	open_counters();
+	printf("Transparent huge pages: %s\n\n", thp);
+	printf("%-12s %10s %8s %11s %10s %10s\n",
+		"pages/touch", "touch(ms)", "GB/s", "stages(ms)", "dTLB-miss", "LLC-miss");
+	for(mode=0; mode<4; mode++)
+	{
+		double touch_time = 0, stage_time = 0, start;
+		double totals[NUM_COUNTERS] = {0};
+		uint64_t before[NUM_COUNTERS], after[NUM_COUNTERS];
+		
+		huge_pages = mode & 1;
+		for(run=0; run<runs; run++)
+		{
+			rng_state = seed + run;
+			start = now_seconds();
+			wallgrids(mode & 2 ? 0 : 1);
+			touch_time += now_seconds() - start;
+			randomize();
+			
+			read_counters(before);
+			start = now_seconds();
+			run_stages(0, generations);
+			stage_time += now_seconds() - start;
+			read_counters(after);
+			for(ii=0; ii<NUM_COUNTERS; ii++)
+				totals[ii] += after[ii] - before[ii];
+			
+			freegrid(grid);
+			freegrid(grid2);
+		}
+		
+		printf("%-12s %10.2f %8.2f %11.2f", mode==0 ? "4k/serial" : mode==1 ? "2M/serial"
+			: mode==2 ? "4k/bands" : "2M/bands", touch_time*1000/runs,
+			2*sizeof(int)*cells / touch_time / 1e9, stage_time*1000/runs);
+		for(ii=0; ii<2; ii++) {
+			int counter = ii==0 ? 5 : 3;   // dTLB-miss, then LLC-miss
+			if(counter_slot[counter] >= 0)
+				printf(" %10.4f", totals[counter] / cells);
+			else
+				printf(" %10s", "n/a");
+		}
+		putchar('\n');
+	}
+	huge_pages = 1;
+}
+
+/*
+ * Tracing for -trace. Each thread records spans (generating, scoring,
+ * waiting for the lock, writing output) into its own ring buffer, so
+ * recording takes no locks; a thread only takes trace_lock once, to add its
+ * ring to the list. If a thread records more than TRACE_RING spans, the
+ * oldest are overwritten. At the end of the run every ring is written out
+ * in the Chrome trace event format, for chrome://tracing or Perfetto.
+ */
+#define TRACE_RING 8192
+
+typedef struct {
+	const char *name;
+	double start, end;   // Seconds, from now_seconds()
+	long arg;            // The candidate's seed, or -1
+} trace_span;
+
+typedef struct trace_ring {
+	trace_span spans[TRACE_RING];
+	unsigned long count;
+	int tid;
+	struct trace_ring *next;
+} trace_ring;
+
+int tracing;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+trace_ring *trace_rings;
+int trace_threads;
+__thread trace_ring *my_trace_ring;
+
+void trace(const char *name, double start, long arg)
+{
+	trace_span *span;
+	
+	if(!tracing)
+		return;
+	if(!my_trace_ring)
+	{
+		my_trace_ring = (trace_ring*)calloc(1, sizeof(trace_ring));
+		pthread_mutex_lock(&trace_lock);
+		my_trace_ring->tid = ++trace_threads;
+		my_trace_ring->next = trace_rings;
+		trace_rings = my_trace_ring;
+		pthread_mutex_unlock(&trace_lock);
+	}
+	span = &my_trace_ring->spans[my_trace_ring->count++ % TRACE_RING];
+	span->name = name;
+	span->start = start;
+	span->end = now_seconds();
+	span->arg = arg;
+}
+
+// Lock #lock, recording the time spent waiting for it.
+void lock_traced(pthread_mutex_t *lock)
+{
+	double start = tracing ? now_seconds() : 0;
+	pthread_mutex_lock(lock);
+	trace("wait", start, -1);
+}
+
+int write_trace(const char *filename)
+{
+	FILE *fout = fopen(filename, "w");
+	trace_ring *ring;
+	double origin = -1;
+	int first = 1;
+	unsigned long ii;
+	
+	if(!fout)
+		return 0;
+	
+	// Start the timeline at the earliest span still recorded
+	for(ring=trace_rings; ring; ring=ring->next)
+	for(ii = ring->count>TRACE_RING ? ring->count-TRACE_RING : 0; ii<ring->count; ii++)
+		if(origin < 0 || ring->spans[ii % TRACE_RING].start < origin)
+			origin = ring->spans[ii % TRACE_RING].start;
+	
+	fprintf(fout, "{\"traceEvents\": [\n");
+	for(ring=trace_rings; ring; ring=ring->next)
+	{
+		fprintf(fout, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %i, "
+			"\"args\": {\"name\": \"thread %i\"}}", first ? "" : ",\n", ring->tid, ring->tid);
+		first = 0;
+		for(ii = ring->count>TRACE_RING ? ring->count-TRACE_RING : 0; ii<ring->count; ii++)
+		{
+			trace_span *span = &ring->spans[ii % TRACE_RING];
+			fprintf(fout, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %i, "
+				"\"ts\": %.3f, \"dur\": %.3f", span->name, ring->tid,
+				(span->start-origin)*1e6, (span->end-span->start)*1e6);
+			if(span->arg >= 0)
+				fprintf(fout, ", \"args\": {\"seed\": %li}", span->arg);
+			fprintf(fout, "}");
+		}
+	}
+	fprintf(fout, "\n]}\n");
+	fclose(fout);
+	return 1;
+}
+
+/*
+ * Best-of-N generation. -candidates N generates N maps from the seeds
+ * seed, seed+1, ... on -j worker threads and keeps the one with the highest
+ * score. A candidate's score is also taken after every stage but the last,
+ * and a candidate that trails the best finished map at the same stage by
+ * more than CANCEL_MARGIN is given up on. The winning seed is reported, and
+ * passing it to -seed reproduces the map.
+ */
+typedef double (*score_func)(const map_stats *stats);
+
+double score_open(const map_stats *stats)      { return stats->open_ratio; }
+double score_connected(const map_stats *stats) { return stats->largest_share; }
+double score_usable(const map_stats *stats)    { return stats->open_ratio * stats->largest_share; }
+
+typedef struct {
+	const char *name;
+	score_func func;
+} score_entry;
+
+score_entry score_funcs[] = {
+	{ "open",      score_open },       // Fraction of the map that's floor
+	{ "connected", score_connected },  // Share of the floor in the largest cave
+	{ "usable",    score_usable },     // Fraction of the map in the largest cave
+	{ NULL, NULL }
+};
+
+#define CANCEL_MARGIN 0.1
+#define MAX_CHECKPOINTS 64
+
+pthread_mutex_t best_lock = PTHREAD_MUTEX_INITIALIZER;
+score_func candidate_score;
+unsigned first_seed;
+int num_candidates, next_candidate, cancelled_candidates;
+int **best_grid;
+unsigned best_seed;
+double best_score;
+double best_checkpoints[MAX_CHECKPOINTS];
+
+void *candidate_worker(void *arg)
+{
+	(void)arg;
+	for(;;)
+	{
+		double checkpoints[MAX_CHECKPOINTS];
+		map_stats stats;
+		double score = 0;
+		unsigned seed;
+		int index, stage, cancelled = 0;
+		double start;
+		
+		lock_traced(&best_lock);
+		index = next_candidate < num_candidates ? next_candidate++ : -1;
+		pthread_mutex_unlock(&best_lock);
+		if(index < 0)
+			break;
+		seed = first_seed + index;
+		
+		rng_state = seed;
+		start = now_seconds();
+		initmap(1);
+		trace("generate", start, seed);
+		for(stage=0; stage<generations && !cancelled; stage++)
+		{
+			start = now_seconds();
+			run_stages(stage, stage+1);
+			trace("generate", start, seed);
+			if(stage == generations-1 || stage >= MAX_CHECKPOINTS)
+				continue;
+			
+			start = now_seconds();
+			compute_stats(&stats);
+			checkpoints[stage] = candidate_score(&stats);
+			trace("score", start, seed);
+			lock_traced(&best_lock);
+			if(best_grid && checkpoints[stage] < best_checkpoints[stage] - CANCEL_MARGIN*fabs(best_checkpoints[stage]))
+				cancelled = 1;
+			pthread_mutex_unlock(&best_lock);
+		}
+		if(!cancelled) {
+			start = now_seconds();
+			compute_stats(&stats);
+			score = candidate_score(&stats);
+			trace("score", start, seed);
+		}
+		
+		lock_traced(&best_lock);
+		if(cancelled)
+			cancelled_candidates++;
+		else if(!best_grid || score > best_score || (score == best_score && seed < best_seed))
+		{
+			int **old = best_grid;
+			best_grid = grid;
+			grid = old;
+			best_score = score;
+			best_seed = seed;
+			memcpy(best_checkpoints, checkpoints, sizeof(checkpoints));
+		}
+		pthread_mutex_unlock(&best_lock);
+		
+		start = now_seconds();
+		if(grid)
+			freegrid(grid);
+		freegrid(grid2);
+		trace("free", start, seed);
+	}
+	return NULL;
+}
+
+void best_of_candidates(int candidates, unsigned seed, int jobs, score_func score)
+{
+	pthread_t *threads = (pthread_t*)malloc(sizeof(pthread_t) * jobs);
+	int ii;
+	
+	candidate_score = score;
+	first_seed = seed;
+	num_candidates = candidates;
+	for(ii=1; ii<jobs; ii++)
+		pthread_create(&threads[ii], NULL, candidate_worker, NULL);
+	candidate_worker(NULL);
+	for(ii=1; ii<jobs; ii++)
+		pthread_join(threads[ii], NULL);
+	free(threads);
+	
+	grid = best_grid;
+	fprintf(stderr, "Best of %i candidates: seed %u, score %f (%i cancelled early)\n",
+		candidates, best_seed, best_score, cancelled_candidates);
 }
 
 void printfunc(void)
 {
 	int ii;
 	
-	printf("W[0](p) = rand[0,100) < %i\n", fillprob);
+	if(loaded_map)
+		printf("W[0](p) = %s\n", loaded_map);
+	else
+		printf("W[0](p) = rand[0,100) < %i\n", fillprob);
 	
 	for(ii=0; ii<generations; ii++)
 	{
+		if(params_set[ii].kernel != KERNEL_THRESHOLD) {
+			const char *rule = params_set[ii].rule, *repeat = strrchr(rule, 'x');
+			printf("Repeat %i: W'(p) = %.*s\n", params_set[ii].reps,
+				repeat ? (int)(repeat-rule) : (int)strlen(rule), rule);
+			continue;
+		}
 		printf("Repeat %i: W'(p) = R[1](p) >= %i",
 			params_set[ii].reps, params_set[ii].r1_cutoff);
 		
@@ -133,58 +1339,334 @@ void printfunc(void)
 	}
 }
 
-void printmap(void)
+/*
+ * printmap() turns rows into text through a tile-to-character table into a
+ * buffer, and writes the buffer with a few large write()s rather than a
+ * putchar() per cell. Big maps go out in chunks of about PRINT_CHUNK bytes,
+ * and each chunk is split into bands formatted by separate threads.
+ */
+#define PRINT_CHUNK (16<<20)
+
+const char tile_chars[2] = { '.', '#' };   // TILE_FLOOR, TILE_WALL
+
+typedef struct {
+	int **g;
+	int first_row, last_row;
+	char *out;
+} print_band;
+
+void *format_band(void *arg)
 {
+	print_band *band = (print_band*)arg;
+	char *out = band->out;
+	const int *row;
 	int xi, yi;
 	
-	for(yi=0; yi<size_y; yi++)
+	for(yi=band->first_row; yi<band->last_row; yi++)
 	{
+		row = band->g[yi];
 		for(xi=0; xi<size_x; xi++)
+			out[xi] = tile_chars[row[xi]];
+		out[size_x] = '\n';
+		out += size_x+1;
+	}
+	return NULL;
+}
+
+int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t written;
+	
+	while(len > 0) {
+		written = write(fd, buf, len);
+		if(written < 0)
+			return 0;
+		buf += written;
+		len -= written;
+	}
+	return 1;
+}
+
+void printmap(void)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int chunk_rows = PRINT_CHUNK / (size_x+1) > 0 ? PRINT_CHUNK / (size_x+1) : 1;
+	int num_bands, first, last, ii;
+	print_band bands[64];
+	pthread_t threads[64];
+	char *buf;
+	
+	if(chunk_rows > size_y)
+		chunk_rows = size_y;
+	buf = (char*)malloc((size_t)chunk_rows * (size_x+1));
+	fflush(stdout);
+	
+	for(first=0; first<size_y; first=last)
+	{
+		last = first+chunk_rows < size_y ? first+chunk_rows : size_y;
+		
+		// Not worth a thread for less than 64 rows each
+		num_bands = cpus > 0 ? (cpus < 64 ? cpus : 64) : 1;
+		if(num_bands > (last-first)/64)
+			num_bands = (last-first)/64 > 0 ? (last-first)/64 : 1;
+		
+		for(ii=0; ii<num_bands; ii++)
+		{
+			bands[ii].g = grid;
+			bands[ii].first_row = first + (long)(last-first) * ii / num_bands;
+			bands[ii].last_row = first + (long)(last-first) * (ii+1) / num_bands;
+			bands[ii].out = buf + (size_t)(bands[ii].first_row-first) * (size_x+1);
+			if(ii > 0)
+				pthread_create(&threads[ii], NULL, format_band, &bands[ii]);
+		}
+		format_band(&bands[0]);
+		for(ii=1; ii<num_bands; ii++)
+			pthread_join(threads[ii], NULL);
+		
+		if(!write_all(STDOUT_FILENO, buf, (size_t)(last-first) * (size_x+1)))
+			break;
+	}
+	free(buf);
+}
+
+/*
+ * Binary map files, for tools that would rather not parse text. A 16-byte
+ * header ("MAPF", then the width, height and encoding as little-endian
+ * 32-bit words) is followed by the cells as the characters printmap() uses,
+ * row by row with no newlines. MAP_PACKED stores one byte per cell; MAP_RLE
+ * stores each row as runs, a cell byte followed by the run length as a
+ * LEB128 varint, and no run goes past the end of a row.
+ */
+#define MAP_PACKED 0
+#define MAP_RLE    1
+
+void put_le32(unsigned char *p, uint32_t value)
+{
+	p[0] = value; p[1] = value>>8; p[2] = value>>16; p[3] = value>>24;
+}
+
+int write_map_file(const char *filename, int encoding)
+{
+	FILE *fout = fopen(filename, "wb");
+	unsigned char header[16] = "MAPF";
+	unsigned char *row;
+	int xi, yi, start, len;
+	unsigned run;
+	
+	if(!fout)
+		return 0;
+	put_le32(header+4, size_x);
+	put_le32(header+8, size_y);
+	put_le32(header+12, encoding);
+	fwrite(header, sizeof header, 1, fout);
+	
+	// A run costs at most two bytes per cell, since its varint can't be
+	// longer than the run
+	row = (unsigned char*)malloc(2*size_x);
+	for(yi=0; yi<size_y; yi++)
+	{
+		len = 0;
+		for(xi=0; xi<size_x; )
 		{
-			switch(grid[yi][xi]) {
-				case TILE_WALL:  putchar('#'); break;
-				case TILE_FLOOR: putchar('.'); break;
+			if(encoding == MAP_PACKED) {
+				row[len++] = tile_chars[grid[yi][xi]];
+				xi++;
+				continue;
 			}
+			start = xi;
+			while(xi<size_x && grid[yi][xi]==grid[yi][start])
+				xi++;
+			row[len++] = tile_chars[grid[yi][start]];
+			for(run=xi-start; run>=0x80; run>>=7)
+				row[len++] = (run & 0x7f) | 0x80;
+			row[len++] = run;
 		}
-		putchar('\n');
+		fwrite(row, len, 1, fout);
 	}
+	free(row);
+	return fclose(fout) == 0;
 }
 
 int main(int argc, char **argv)
 {
-	int ii, jj;
+	int ii;
+	int argi = 1;
+	const char *pin_filename = NULL, *metrics_filename = NULL, *trace_filename = NULL;
+	const char *map_filename = NULL, *load_filename = NULL;
+	int map_encoding = MAP_PACKED;
+	int region[4], have_region = 0;
+	int first_stage;
+	double start;
+	int coarse_factor = 1, fine_stages = 1, bench_runs = 0, page_bench_runs = 0;
+	int candidates = 0, jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	score_func score = score_usable;
+	unsigned seed = time(NULL);
 	
-	if(argc < 7) {
-		printf("Usage: %s xsize ysize fill (r1 r2 count)+\n", argv[0]);
+	for(; argi<argc && argv[argi][0]=='-'; argi++)
+	{
+		if(!strcmp(argv[argi], "-pin") && argi+1<argc)
+			pin_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-coarse") && argi+1<argc)
+			coarse_factor = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-fine") && argi+1<argc)
+			fine_stages = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-bench") && argi+1<argc)
+			bench_runs = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-pagebench") && argi+1<argc)
+			page_bench_runs = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-seed") && argi+1<argc)
+			seed = strtoul(argv[++argi], NULL, 0);
+		else if(!strcmp(argv[argi], "-metrics") && argi+1<argc)
+			metrics_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-trace") && argi+1<argc)
+			trace_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-load") && argi+1<argc)
+			load_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-region") && argi+1<argc)
+		{
+			if(sscanf(argv[++argi], "%d,%d,%d,%d", &region[0], &region[1], &region[2], &region[3]) != 4) {
+				fprintf(stderr, "Regions are given as x0,y0,x1,y1.\n");
+				return 1;
+			}
+			have_region = 1;
+		}
+		else if(!strcmp(argv[argi], "-fill") && argi+1<argc)
+			fillprob = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-binary") && argi+1<argc) {
+			map_filename = argv[++argi];
+			map_encoding = MAP_PACKED;
+		}
+		else if(!strcmp(argv[argi], "-rle") && argi+1<argc) {
+			map_filename = argv[++argi];
+			map_encoding = MAP_RLE;
+		}
+		else if(!strcmp(argv[argi], "-candidates") && argi+1<argc)
+			candidates = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-j") && argi+1<argc)
+			jobs = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-score") && argi+1<argc)
+		{
+			for(ii=0; score_funcs[ii].name && strcmp(score_funcs[ii].name, argv[argi+1]); ii++);
+			if(!score_funcs[ii].name) {
+				fprintf(stderr, "Unknown score %s.\n", argv[argi+1]);
+				return 1;
+			}
+			score = score_funcs[ii].func;
+			argi++;
+		}
+		else
+			break;
+	}
+	if(!load_filename && argc-argi < 4) {
+		printf("Usage: %s [-pin maskfile] [-coarse factor [-fine stages]] [-bench runs] [-pagebench runs] [-seed n]\n"
+		       "          [-candidates n [-j threads] [-score open|connected|usable]] [-trace file.json]\n"
+		       "          [-binary file | -rle file] [-metrics file.json] xsize ysize fill (r1 r2 count | rule)+\n"
+		       "       %s [-pin maskfile] [-seed n] [-trace file.json] [-binary file | -rle file]\n"
+		       "          [-metrics file.json] -load map.txt [-region x0,y0,x1,y1 [-fill n]]\n"
+		       "          (r1 r2 count | rule)*\n", argv[0], argv[0]);
+		return 1;
+	}
+	if(load_filename) {
+		if(candidates > 0 || coarse_factor > 1) {
+			fprintf(stderr, "-load can't be combined with -candidates or -coarse.\n");
+			return 1;
+		}
+		if(!load_map(load_filename)) {
+			fprintf(stderr, "Could not read map %s.\n", load_filename);
+			return 1;
+		}
+		first_stage = argi;
+		if(have_region && (region[0] < 1 || region[1] < 1 || region[2] > size_x-1
+		                   || region[3] > size_y-1 || region[0] >= region[2] || region[1] >= region[3])) {
+			fprintf(stderr, "The region must be a non-empty rectangle inside the map's border.\n");
+			return 1;
+		}
+	} else if(have_region) {
+		fprintf(stderr, "-region needs a map from -load.\n");
 		return 1;
+	} else {
+		size_x     = atoi(argv[argi]);
+		size_y     = atoi(argv[argi+1]);
+		fillprob   = atoi(argv[argi+2]);
+		first_stage = argi+3;
 	}
-	size_x     = atoi(argv[1]);
-	size_y     = atoi(argv[2]);
-	fillprob   = atoi(argv[3]);
 	
-	generations = (argc-4)/3;
+	params = params_set = (generation_params*)malloc( sizeof(generation_params) * (argc-argi+1) );
 	
-	params = params_set = (generation_params*)malloc( sizeof(generation_params) * generations );
+	if(pin_filename && !load_pins(pin_filename)) {
+		fprintf(stderr, "Could not read pin mask %s.\n", pin_filename);
+		return 1;
+	}
 	
-	for(ii=4; ii+2<argc; ii+=3)
+	// Each stage is either a rule string or an "r1 r2 count" triple
+	for(ii=first_stage; ii<argc; )
 	{
-		params->r1_cutoff  = atoi(argv[ii]);
-		params->r2_cutoff  = atoi(argv[ii+1]);
-		params->reps = atoi(argv[ii+2]);
+		if(strchr(argv[ii], 'R')) {
+			if(!parse_rule(argv[ii], params)) {
+				fprintf(stderr, "Can't parse rule %s.\n", argv[ii]);
+				return 1;
+			}
+			ii++;
+		} else if(ii+2 < argc) {
+			threshold_rule(atoi(argv[ii]), atoi(argv[ii+1]), atoi(argv[ii+2]), params);
+			ii += 3;
+		} else
+			break;
 		params++;
 	}
+	generations = params - params_set;
 	
-	srand(time(NULL));
+	if(bench_runs > 0) {
+		benchmark(bench_runs, seed, coarse_factor>1 ? coarse_factor : 2, fine_stages);
+		return 0;
+	}
+	if(page_bench_runs > 0) {
+		page_benchmark(page_bench_runs, seed);
+		return 0;
+	}
 	
-	initmap();
+	rng_state = seed;
+	tracing = trace_filename != NULL;
 	
-	for(ii=0; ii<generations; ii++)
-	{
-		params = &params_set[ii];
-		for(jj=0; jj<params->reps; jj++)
-			generation();
+	if(candidates > 0 && coarse_factor > 1) {
+		fprintf(stderr, "-candidates can't be combined with -coarse.\n");
+		return 1;
 	}
+	if(candidates > 0)
+		best_of_candidates(candidates, seed, jobs>0 ? jobs : 1, score);
+	else if(coarse_factor > 1)
+		multigrid_generate(coarse_factor, fine_stages);
+	else {
+		start = now_seconds();
+		if(have_region)
+			regenerate_region(region[0], region[1], region[2], region[3]);
+		else {
+			if(loaded_map)
+				apply_pins();
+			else
+				initmap(1);
+			run_stages(0, generations);
+		}
+		trace("generate", start, seed);
+	}
+	
+	start = now_seconds();
 	printfunc();
 	printmap();
+	fflush(stdout);
+	if(map_filename && !write_map_file(map_filename, map_encoding)) {
+		fprintf(stderr, "Could not write map to %s.\n", map_filename);
+		return 1;
+	}
+	trace("write", start, -1);
+	
+	if(metrics_filename && !write_metrics(metrics_filename)) {
+		fprintf(stderr, "Could not write metrics to %s.\n", metrics_filename);
+		return 1;
+	}
+	if(trace_filename && !write_trace(trace_filename)) {
+		fprintf(stderr, "Could not write trace to %s.\n", trace_filename);
+		return 1;
+	}
 	return 0;
 }
\ No newline at end of file
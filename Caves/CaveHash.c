@@ -0,0 +1,678 @@
+/*
+ * Copyright (c) 2026 The Random Cave Tutorials contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ */
+/*
+ * Experimental Hashlife-style engine for the cave automaton in Cave.c.
+ *
+ * The map is stored as a quadtree whose nodes are hash-consed, so identical
+ * areas (solid rock, open space, repeated shapes) are stored once no matter
+ * how often they appear, in one map or across a whole batch of maps. The
+ * result of advancing a node by some number of generations under a rule is
+ * memoized for the whole run too, so once an area has been worked out, every
+ * copy of it in any stage or map is free. The cost of a stage then depends
+ * on how much distinct structure the map has rather than on its area.
+ *
+ * Each cell has a wall bit and a pinned bit. Pinned cells never change: the
+ * map's border is pinned wall, and everything outside the map is pinned
+ * floor, which counts the same as the cells Cave.c skips at the edge. That
+ * makes the result identical to Cave.c's generation(), which -bench checks.
+ *
+ * A node of level k covers 2^k x 2^k cells. Level 3 nodes are leaves holding
+ * 8x8 cells as bitmasks. advance(n, t) returns the level k-1 node at the
+ * center of n, t generations later. The rule reaches 2 cells, so that needs
+ * 2t <= 2^(k-2).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TILE_FLOOR 0
+#define TILE_WALL 1
+
+typedef struct {
+	int r1_cutoff, r2_cutoff;
+	int reps;
+} generation_params;
+
+int **grid;
+int **grid2;
+
+int fillprob = 40;
+int size_x = 64, size_y = 20;
+generation_params *params;
+
+generation_params *params_set;
+int generations;
+
+typedef struct node
+{
+	int level;
+	struct node *child[4];     // nw, ne, sw, se; unused in leaves
+	uint64_t wall, pinned;     // Leaves only: bit y*8+x for each cell
+	uint64_t hash;
+	struct node *next;         // Next node in the same hash bucket
+} node;
+
+#define LEAF_LEVEL 3
+
+
+/*
+ * Node storage and the table of unique nodes.
+ */
+#define NODE_CHUNK 65536
+node *node_chunk;
+int node_chunk_used = NODE_CHUNK;
+long total_nodes;
+
+node **unique_table;
+size_t unique_buckets, unique_count;
+
+node *alloc_node(void)
+{
+	if(node_chunk_used == NODE_CHUNK) {
+		node_chunk = (node*)malloc(sizeof(node) * NODE_CHUNK);
+		node_chunk_used = 0;
+	}
+	total_nodes++;
+	return &node_chunk[node_chunk_used++];
+}
+
+uint64_t mix(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+void grow_unique_table(void)
+{
+	size_t new_buckets = unique_buckets ? unique_buckets*2 : 1<<16;
+	node **new_table = (node**)calloc(new_buckets, sizeof(node*));
+	size_t ii;
+
+	for(ii=0; ii<unique_buckets; ii++)
+	{
+		node *n = unique_table[ii], *next;
+		for(; n; n=next) {
+			next = n->next;
+			n->next = new_table[n->hash & (new_buckets-1)];
+			new_table[n->hash & (new_buckets-1)] = n;
+		}
+	}
+	free(unique_table);
+	unique_table = new_table;
+	unique_buckets = new_buckets;
+}
+
+node *leaf(uint64_t wall, uint64_t pinned)
+{
+	uint64_t hash = mix(wall ^ mix(pinned));
+	node *n;
+
+	if(unique_count >= unique_buckets)
+		grow_unique_table();
+	for(n = unique_table[hash & (unique_buckets-1)]; n; n=n->next)
+		if(n->level==LEAF_LEVEL && n->wall==wall && n->pinned==pinned)
+			return n;
+
+	n = alloc_node();
+	n->level = LEAF_LEVEL;
+	n->wall = wall;
+	n->pinned = pinned;
+	n->hash = hash;
+	n->next = unique_table[hash & (unique_buckets-1)];
+	unique_table[hash & (unique_buckets-1)] = n;
+	unique_count++;
+	return n;
+}
+
+node *join(node *nw, node *ne, node *sw, node *se)
+{
+	uint64_t hash = mix(nw->hash + 3*mix(ne->hash + 5*mix(sw->hash + 7*se->hash)));
+	node *n;
+
+	if(unique_count >= unique_buckets)
+		grow_unique_table();
+	for(n = unique_table[hash & (unique_buckets-1)]; n; n=n->next)
+		if(n->level==nw->level+1 && n->child[0]==nw && n->child[1]==ne
+		 && n->child[2]==sw && n->child[3]==se)
+			return n;
+
+	n = alloc_node();
+	n->level = nw->level+1;
+	n->child[0] = nw;
+	n->child[1] = ne;
+	n->child[2] = sw;
+	n->child[3] = se;
+	n->hash = hash;
+	n->next = unique_table[hash & (unique_buckets-1)];
+	unique_table[hash & (unique_buckets-1)] = n;
+	unique_count++;
+	return n;
+}
+
+// A node of the given level that's entirely outside the map.
+node *empty_nodes[64];
+
+node *empty(int level)
+{
+	if(!empty_nodes[level]) {
+		if(level == LEAF_LEVEL)
+			empty_nodes[level] = leaf(0, ~(uint64_t)0);
+		else {
+			node *e = empty(level-1);
+			empty_nodes[level] = join(e, e, e, e);
+		}
+	}
+	return empty_nodes[level];
+}
+
+
+/*
+ * Memoized results of advance(), keyed by node, number of generations and
+ * rule. Nodes are never freed, so the table is kept for the whole run and
+ * every stage and every map in a batch can reuse what the others worked out.
+ */
+typedef struct {
+	node *key;
+	int gens;
+	int r1_cutoff, r2_cutoff;
+	node *result;
+} memo_entry;
+
+memo_entry *memo_table;
+size_t memo_size, memo_count;
+long memo_hits, memo_misses;
+
+int memo_same_key(const memo_entry *a, const memo_entry *b)
+{
+	return a->key == b->key && a->gens == b->gens
+	    && a->r1_cutoff == b->r1_cutoff && a->r2_cutoff == b->r2_cutoff;
+}
+
+// Find the slot for #entry's key: the one holding it, or the empty slot
+// where it would go.
+size_t memo_slot(memo_entry *table, size_t size, const memo_entry *entry)
+{
+	uint64_t rule = (uint64_t)(uint32_t)entry->r1_cutoff << 32 | (uint32_t)entry->r2_cutoff;
+	size_t slot = mix(entry->key->hash + mix(rule + entry->gens)) & (size-1);
+	while(table[slot].key && !memo_same_key(&table[slot], entry))
+		slot = (slot+1) & (size-1);
+	return slot;
+}
+
+void memo_insert(const memo_entry *entry)
+{
+	if(2*(memo_count+1) > memo_size)
+	{
+		size_t new_size = memo_size ? memo_size*2 : 1<<16;
+		memo_entry *new_table = (memo_entry*)calloc(new_size, sizeof(memo_entry));
+		size_t ii;
+		for(ii=0; ii<memo_size; ii++)
+			if(memo_table[ii].key)
+				new_table[memo_slot(new_table, new_size, &memo_table[ii])] = memo_table[ii];
+		free(memo_table);
+		memo_table = new_table;
+		memo_size = new_size;
+	}
+	memo_table[memo_slot(memo_table, memo_size, entry)] = *entry;
+	memo_count++;
+}
+
+
+/*
+ * Advancing nodes.
+ */
+
+// Brute force for level 4 nodes: unpack the 16x16 cells into row masks,
+// run up to two generations, and pack the center 8x8 into a leaf.
+node *advance_base(node *n, int gens)
+{
+	uint32_t wall[2][16], pinned[16];
+	uint64_t out_wall = 0, out_pinned = 0;
+	int xi, yi, g, cur = 0;
+
+	for(yi=0; yi<16; yi++)
+	{
+		node *west = n->child[(yi>=8)*2], *east = n->child[(yi>=8)*2+1];
+		int shift = (yi&7)*8;
+		wall[0][yi] = ((west->wall >> shift) & 0xFF) | ((east->wall >> shift) & 0xFF) << 8;
+		pinned[yi] = ((west->pinned >> shift) & 0xFF) | ((east->pinned >> shift) & 0xFF) << 8;
+	}
+
+	for(g=0; g<gens; g++)
+	{
+		int lo = 2*(g+1), hi = 16-2*(g+1);
+		for(yi=lo; yi<hi; yi++)
+		{
+			uint32_t row = wall[cur][yi];
+			for(xi=lo; xi<hi; xi++)
+			{
+				// 5-wide windows centered on the cell; 0xE is the middle three
+				int adjcount_r1 = __builtin_popcount((wall[cur][yi-1] >> (xi-2)) & 0xE)
+				                + __builtin_popcount((wall[cur][yi  ] >> (xi-2)) & 0xE)
+				                + __builtin_popcount((wall[cur][yi+1] >> (xi-2)) & 0xE);
+				int adjcount_r2 = adjcount_r1
+				                + __builtin_popcount((wall[cur][yi-2] >> (xi-2)) & 0xE)
+				                + __builtin_popcount((wall[cur][yi-1] >> (xi-2)) & 0x11)
+				                + __builtin_popcount((wall[cur][yi  ] >> (xi-2)) & 0x11)
+				                + __builtin_popcount((wall[cur][yi+1] >> (xi-2)) & 0x11)
+				                + __builtin_popcount((wall[cur][yi+2] >> (xi-2)) & 0xE);
+				uint32_t bit = (uint32_t)1 << xi;
+
+				if(pinned[yi] & bit)
+					continue;
+				if(adjcount_r1 >= params->r1_cutoff || adjcount_r2 <= params->r2_cutoff)
+					row |= bit;
+				else
+					row &= ~bit;
+			}
+			wall[!cur][yi] = row;
+		}
+		cur = !cur;
+	}
+
+	for(yi=0; yi<8; yi++)
+	{
+		out_wall   |= (uint64_t)((wall[cur][yi+4] >> 4) & 0xFF) << (yi*8);
+		out_pinned |= (uint64_t)((pinned[yi+4] >> 4) & 0xFF) << (yi*8);
+	}
+	return leaf(out_wall, out_pinned);
+}
+
+node *advance(node *n, int gens)
+{
+	memo_entry entry = { n, gens, params->r1_cutoff, params->r2_cutoff, NULL };
+	node *result;
+
+	if(memo_size) {
+		memo_entry *found = &memo_table[memo_slot(memo_table, memo_size, &entry)];
+		if(found->key) {
+			memo_hits++;
+			return found->result;
+		}
+	}
+	memo_misses++;
+
+	// Nothing inside an area that's entirely outside the map ever changes
+	if(n == empty(n->level))
+		result = empty(n->level-1);
+	else if(n->level == LEAF_LEVEL+1)
+		result = advance_base(n, gens);
+	else if(gens == 0)
+		result = join(n->child[0]->child[3], n->child[1]->child[2],
+		              n->child[2]->child[1], n->child[3]->child[0]);
+	else
+	{
+		node *nw = n->child[0], *ne = n->child[1], *sw = n->child[2], *se = n->child[3];
+		int t1 = gens < (1 << (n->level-4)) ? gens : (1 << (n->level-4));
+		int t2 = gens - t1;
+		node *r00, *r01, *r02, *r10, *r11, *r12, *r20, *r21, *r22;
+
+		// Nine overlapping half-size nodes, each advanced by t1...
+		r00 = advance(nw, t1);
+		r01 = advance(join(nw->child[1], ne->child[0], nw->child[3], ne->child[2]), t1);
+		r02 = advance(ne, t1);
+		r10 = advance(join(nw->child[2], nw->child[3], sw->child[0], sw->child[1]), t1);
+		r11 = advance(join(nw->child[3], ne->child[2], sw->child[1], se->child[0]), t1);
+		r12 = advance(join(ne->child[2], ne->child[3], se->child[0], se->child[1]), t1);
+		r20 = advance(sw, t1);
+		r21 = advance(join(sw->child[1], se->child[0], sw->child[3], se->child[2]), t1);
+		r22 = advance(se, t1);
+
+		// ...then combined into four and advanced by the remaining t2
+		result = join(advance(join(r00, r01, r10, r11), t2),
+		              advance(join(r01, r02, r11, r12), t2),
+		              advance(join(r10, r11, r20, r21), t2),
+		              advance(join(r11, r12, r21, r22), t2));
+	}
+
+	entry.result = result;
+	memo_insert(&entry);
+	return result;
+}
+
+
+/*
+ * Converting between the flat grid and the quadtree. The map sits at
+ * (#offset, #offset) in a universe of 2^level x 2^level cells.
+ */
+node *build(int level, int x0, int y0, int offset)
+{
+	int xi, yi;
+
+	// Entirely outside the map
+	if(x0+(1<<level) <= offset || y0+(1<<level) <= offset
+	 || x0 >= offset+size_x || y0 >= offset+size_y)
+		return empty(level);
+
+	if(level == LEAF_LEVEL)
+	{
+		uint64_t wall = 0, pinned = 0;
+		for(yi=0; yi<8; yi++)
+		for(xi=0; xi<8; xi++)
+		{
+			int x = x0+xi-offset, y = y0+yi-offset;
+			int bit = yi*8 + xi;
+			if(x<0 || y<0 || x>=size_x || y>=size_y)
+				pinned |= (uint64_t)1 << bit;
+			else {
+				wall |= (uint64_t)(grid[y][x] != TILE_FLOOR) << bit;
+				if(x==0 || y==0 || x==size_x-1 || y==size_y-1)
+					pinned |= (uint64_t)1 << bit;
+			}
+		}
+		return leaf(wall, pinned);
+	}
+
+	return join(build(level-1, x0,                  y0,                  offset),
+	            build(level-1, x0+(1<<(level-1)), y0,                  offset),
+	            build(level-1, x0,                  y0+(1<<(level-1)), offset),
+	            build(level-1, x0+(1<<(level-1)), y0+(1<<(level-1)), offset));
+}
+
+// Write the cells of #n, whose top-left corner is at map position
+// (#x0,#y0), into the grid.
+void flatten(node *n, int x0, int y0)
+{
+	int xi, yi;
+
+	if(x0 >= size_x || y0 >= size_y || x0+(1<<n->level) <= 0 || y0+(1<<n->level) <= 0)
+		return;
+	if(n->level == LEAF_LEVEL)
+	{
+		for(yi=0; yi<8; yi++)
+		for(xi=0; xi<8; xi++)
+		{
+			int x = x0+xi, y = y0+yi;
+			if(x>=0 && y>=0 && x<size_x && y<size_y)
+				grid[y][x] = (n->wall >> (yi*8+xi)) & 1 ? TILE_WALL : TILE_FLOOR;
+		}
+		return;
+	}
+	flatten(n->child[0], x0,                     y0);
+	flatten(n->child[1], x0+(1<<(n->level-1)), y0);
+	flatten(n->child[2], x0,                     y0+(1<<(n->level-1)));
+	flatten(n->child[3], x0+(1<<(n->level-1)), y0+(1<<(n->level-1)));
+}
+
+// Run every stage on the grid through the quadtree, and write the result
+// back into the grid.
+void hash_generate(void)
+{
+	int level = LEAF_LEVEL+1;
+	int largest = size_x>size_y ? size_x : size_y;
+	int max_reps = 0;
+	int ii, offset;
+	node *root, *result, *e;
+
+	for(ii=0; ii<generations; ii++)
+		if(params_set[ii].reps > max_reps)
+			max_reps = params_set[ii].reps;
+
+	// The map must fit in the center half, with room for the largest stage
+	while((1 << (level-1)) < largest || (1 << (level-2)) < 2*max_reps)
+		level++;
+	offset = 1 << (level-2);
+
+	root = build(level, 0, 0, offset);
+	result = NULL;
+	for(ii=0; ii<generations; ii++)
+	{
+		params = &params_set[ii];
+		result = advance(root, params->reps);
+
+		// Put the result back in the middle of an empty universe
+		e = empty(level-2);
+		root = join(join(e, e, e, result->child[0]),
+		            join(e, e, result->child[1], e),
+		            join(e, result->child[2], e, e),
+		            join(result->child[3], e, e, e));
+	}
+
+	flatten(root, -offset, -offset);
+}
+
+
+/*
+ * The flat kernel from Cave.c, for comparison.
+ */
+int randpick(void)
+{
+	if(rand()%100 < fillprob)
+		return TILE_WALL;
+	else
+		return TILE_FLOOR;
+}
+
+void initmap(void)
+{
+	int xi, yi;
+
+	grid  = (int**)malloc(sizeof(int*) * size_y);
+	grid2 = (int**)malloc(sizeof(int*) * size_y);
+
+	for(yi=0; yi<size_y; yi++)
+	{
+		grid [yi] = (int*)malloc(sizeof(int) * size_x);
+		grid2[yi] = (int*)malloc(sizeof(int) * size_x);
+	}
+
+	for(yi=1; yi<size_y-1; yi++)
+	for(xi=1; xi<size_x-1; xi++)
+		grid[yi][xi] = randpick();
+
+	for(yi=0; yi<size_y; yi++)
+	for(xi=0; xi<size_x; xi++)
+		grid2[yi][xi] = TILE_WALL;
+
+	for(yi=0; yi<size_y; yi++)
+		grid[yi][0] = grid[yi][size_x-1] = TILE_WALL;
+	for(xi=0; xi<size_x; xi++)
+		grid[0][xi] = grid[size_y-1][xi] = TILE_WALL;
+}
+
+void freemap(void)
+{
+	int yi;
+
+	for(yi=0; yi<size_y; yi++) {
+		free(grid[yi]);
+		free(grid2[yi]);
+	}
+	free(grid);
+	free(grid2);
+}
+
+void generation(void)
+{
+	int xi, yi, ii, jj;
+
+	for(yi=1; yi<size_y-1; yi++)
+	for(xi=1; xi<size_x-1; xi++)
+	{
+		int adjcount_r1 = 0,
+		    adjcount_r2 = 0;
+
+		for(ii=-1; ii<=1; ii++)
+		for(jj=-1; jj<=1; jj++)
+		{
+			if(grid[yi+ii][xi+jj] != TILE_FLOOR)
+				adjcount_r1++;
+		}
+		for(ii=yi-2; ii<=yi+2; ii++)
+		for(jj=xi-2; jj<=xi+2; jj++)
+		{
+			if(abs(ii-yi)==2 && abs(jj-xi)==2)
+				continue;
+			if(ii<0 || jj<0 || ii>=size_y || jj>=size_x)
+				continue;
+			if(grid[ii][jj] != TILE_FLOOR)
+				adjcount_r2++;
+		}
+		if(adjcount_r1 >= params->r1_cutoff || adjcount_r2 <= params->r2_cutoff)
+			grid2[yi][xi] = TILE_WALL;
+		else
+			grid2[yi][xi] = TILE_FLOOR;
+	}
+	for(yi=1; yi<size_y-1; yi++)
+	for(xi=1; xi<size_x-1; xi++)
+		grid[yi][xi] = grid2[yi][xi];
+}
+
+void flat_generate(void)
+{
+	int ii, jj;
+
+	for(ii=0; ii<generations; ii++)
+	{
+		params = &params_set[ii];
+		for(jj=0; jj<params->reps; jj++)
+			generation();
+	}
+}
+
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void printmap(void)
+{
+	int xi, yi;
+
+	for(yi=0; yi<size_y; yi++)
+	{
+		for(xi=0; xi<size_x; xi++)
+		{
+			switch(grid[yi][xi]) {
+				case TILE_WALL:  putchar('#'); break;
+				case TILE_FLOOR: putchar('.'); break;
+			}
+		}
+		putchar('\n');
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int ii, xi, yi;
+	int argi = 1;
+	int batch = 1, bench = 0;
+	unsigned seed = time(NULL);
+
+	for(; argi<argc && argv[argi][0]=='-'; argi++)
+	{
+		if(!strcmp(argv[argi], "-batch") && argi+1<argc)
+			batch = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-bench"))
+			bench = 1;
+		else if(!strcmp(argv[argi], "-seed") && argi+1<argc)
+			seed = strtoul(argv[++argi], NULL, 0);
+		else
+			break;
+	}
+	if(argc-argi < 6) {
+		printf("Usage: %s [-batch maps] [-bench] [-seed n] xsize ysize fill (r1 r2 count)+\n", argv[0]);
+		return 1;
+	}
+	size_x     = atoi(argv[argi]);
+	size_y     = atoi(argv[argi+1]);
+	fillprob   = atoi(argv[argi+2]);
+
+	generations = (argc-argi-3)/3;
+	params = params_set = (generation_params*)malloc( sizeof(generation_params) * generations );
+	for(ii=argi+3; ii+2<argc; ii+=3)
+	{
+		params->r1_cutoff  = atoi(argv[ii]);
+		params->r2_cutoff  = atoi(argv[ii+1]);
+		params->reps = atoi(argv[ii+2]);
+		params++;
+	}
+
+	if(bench)
+		printf("%-5s %10s %10s %10s %12s %10s\n", "map", "flat(ms)", "hash(ms)", "nodes", "memo hits", "match");
+
+	// Maps in a batch share the node table, so structure repeated between
+	// them is only stored and worked out once
+	for(ii=0; ii<batch; ii++)
+	{
+		srand(seed + ii);
+		initmap();
+
+		if(bench)
+		{
+			int **flat = (int**)malloc(sizeof(int*) * size_y);
+			double start, flat_time, hash_time;
+			int match = 1;
+			long hits = memo_hits;
+
+			for(yi=0; yi<size_y; yi++) {
+				flat[yi] = (int*)malloc(sizeof(int) * size_x);
+				memcpy(flat[yi], grid[yi], sizeof(int) * size_x);
+			}
+
+			start = now_seconds();
+			hash_generate();
+			hash_time = now_seconds() - start;
+
+			// Swap in the copy of the starting map for the flat kernel
+			for(yi=0; yi<size_y; yi++) {
+				int *row = grid[yi];
+				grid[yi] = flat[yi];
+				flat[yi] = row;
+			}
+			start = now_seconds();
+			flat_generate();
+			flat_time = now_seconds() - start;
+
+			for(yi=0; yi<size_y; yi++)
+			for(xi=0; xi<size_x; xi++)
+				if(grid[yi][xi] != flat[yi][xi])
+					match = 0;
+
+			printf("%-5i %10.2f %10.2f %10li %12li %10s\n", ii, flat_time*1000, hash_time*1000,
+				total_nodes, memo_hits-hits, match ? "yes" : "NO");
+
+			for(yi=0; yi<size_y; yi++)
+				free(flat[yi]);
+			free(flat);
+		}
+		else
+		{
+			hash_generate();
+			printmap();
+			if(ii+1 < batch)
+				putchar('\n');
+		}
+		freemap();
+	}
+	return 0;
+}
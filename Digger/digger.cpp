@@ -34,6 +34,8 @@
 #include <cstdlib>
 #include <ctime>
 #include <cassert>
+#include <cstring>
+#include <vector>
 using namespace std;
 
 //
@@ -78,6 +80,7 @@ void dig_tile(Vector v);
 void door_tile(Vector v);
 void fill_tile(Vector v);
 int rand_range(int Min, int Max);
+void prune_dead_ends(void);
 
 
 enum { TILE_UNKNOWN, TILE_FLOOR, TILE_WALL, TILE_DOOR };
@@ -264,6 +267,69 @@ void fill_tile(Vector v) {
 }
 
 
+int is_open(Vector v)
+{
+	return grid[v.y][v.x] == TILE_FLOOR || grid[v.y][v.x] == TILE_DOOR;
+}
+int count_open_neighbours(Vector v)
+{
+	return is_open(v+Vector(1,0)) + is_open(v-Vector(1,0))
+	     + is_open(v+Vector(0,1)) + is_open(v-Vector(0,1));
+}
+int borders_open(Vector v)
+{
+	for(int ii=-1; ii<=1; ii++)
+	for(int jj=-1; jj<=1; jj++)
+		if(is_in_bounds_or_border(v+Vector(jj, ii)) && is_open(v+Vector(jj, ii)))
+			return 1;
+	return 0;
+}
+
+// Fill in dead ends: any floor or door tile with only one open neighbour is
+// turned back into wall, and its neighbour is checked again, so corridors
+// are peeled back until they reach a junction or a room. Every tile is
+// queued once at the start and at most once more per neighbour it loses, so
+// this is linear in the area of the map. The border, where the entrance is,
+// is left alone. Walls that no longer border anything open go back to being
+// unknown, so pruned corridors don't leave solid rock behind.
+void prune_dead_ends(void)
+{
+	const Vector dirs[4] = { Vector(1,0), Vector(-1,0), Vector(0,1), Vector(0,-1) };
+	std::vector<Vector> queue;
+	
+	for(int yi=1; yi<size_y-1; yi++)
+	for(int xi=1; xi<size_x-1; xi++)
+	{
+		Vector pos(xi, yi);
+		if(is_open(pos) && count_open_neighbours(pos) <= 1)
+			queue.push_back(pos);
+	}
+	
+	while(queue.size() > 0)
+	{
+		Vector pos = queue.back();
+		queue.pop_back();
+		
+		if(!is_open(pos) || count_open_neighbours(pos) > 1)
+			continue;
+		fill_tile(pos);
+		
+		for(int ii=-1; ii<=1; ii++)
+		for(int jj=-1; jj<=1; jj++)
+		{
+			Vector wall = pos + Vector(jj, ii);
+			if(is_in_bounds_or_border(wall) && !is_open(wall) && !borders_open(wall))
+				grid[wall.y][wall.x] = TILE_UNKNOWN;
+		}
+		for(int ii=0; ii<4; ii++) {
+			Vector next = pos + dirs[ii];
+			if(is_in_bounds(next) && is_open(next))
+				queue.push_back(next);
+		}
+	}
+}
+
+
 // Return a random number between Min and Max.
 int rand_range(int Min, int Max)
 {
@@ -305,17 +371,29 @@ void print_map(void)
 
 int main(int argc, char **argv)
 {
-	if(argc < 3) {
-		printf("Usage: %s xsize ysize\n", argv[0]);
+	int argi = 1;
+	bool prune = false;
+	
+	for(; argi<argc && argv[argi][0]=='-'; argi++)
+	{
+		if(!strcmp(argv[argi], "-prune"))
+			prune = true;
+		else
+			break;
+	}
+	if(argc-argi < 2) {
+		printf("Usage: %s [-prune] xsize ysize\n", argv[0]);
 		return 1;
 	}
-	size_x     = atoi(argv[1]);
-	size_y     = atoi(argv[2]);
+	size_x     = atoi(argv[argi]);
+	size_y     = atoi(argv[argi+1]);
 	
 	srand(time(NULL));
 	init_map();
 	
 	dig_room(Vector(size_x/2, size_y-1), Vector(0, -1));
+	if(prune)
+		prune_dead_ends();
 	
 	print_map();
 	return 0;
@@ -34,7 +34,21 @@
 #include <cstdlib>
 #include <ctime>
 #include <cassert>
+#include <cstring>
+#include <cstdint>
+#include <climits>
 #include <vector>
+#include <string>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <cmath>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../Tools/perf_counters.h"
 using namespace std;
 
 //
@@ -50,26 +64,38 @@ class Vector
 public:
 	int x, y;
 	
-	inline Vector()             { x=y=0; }
-	inline Vector(int x, int y) { this->x=x; this->y=y; }
+	constexpr Vector()             : x(0), y(0) { }
+	constexpr Vector(int x, int y) : x(x), y(y) { }
 	
-	inline Vector  operator+(const Vector &vec)  { return Vector(x+vec.x, y+vec.y); }
-	inline Vector  operator-(const Vector &vec)  { return Vector(x-vec.x, y-vec.y); }
-	inline Vector& operator+=(const Vector &vec) { x += vec.x; y += vec.y; return *this; }
-	inline Vector& operator-=(const Vector &vec) { x -= vec.x; y -= vec.y; return *this; }
-	inline Vector  operator*(int scalar)         { return Vector(x*scalar, y*scalar); }
+	constexpr Vector operator+(const Vector &vec) const { return Vector(x+vec.x, y+vec.y); }
+	constexpr Vector operator-(const Vector &vec) const { return Vector(x-vec.x, y-vec.y); }
+	inline    Vector& operator+=(const Vector &vec)     { x += vec.x; y += vec.y; return *this; }
+	inline    Vector& operator-=(const Vector &vec)     { x -= vec.x; y -= vec.y; return *this; }
+	constexpr Vector operator*(int scalar)        const { return Vector(x*scalar, y*scalar); }
 	
-	inline friend Vector operator*(int scalar, Vector vec) { return Vector(vec.x*scalar, vec.y*scalar); }
+	constexpr friend Vector operator*(int scalar, const Vector &vec) { return Vector(vec.x*scalar, vec.y*scalar); }
 	
-	inline bool operator==(const Vector &vec) { return x==vec.x && y==vec.y; }
-	inline bool operator!=(const Vector &vec) { return x!=vec.x || y!=vec.y; }
+	constexpr bool operator==(const Vector &vec) const { return x==vec.x && y==vec.y; }
+	constexpr bool operator!=(const Vector &vec) const { return x!=vec.x || y!=vec.y; }
 	
-	inline Vector left()   { return Vector(y, -x); }
-	inline Vector right()  { return Vector(-y, x); }
+	constexpr Vector left()  const { return Vector(y, -x); }
+	constexpr Vector right() const { return Vector(-y, x); }
 };
+
+// The four headings, clockwise from north, and the index of a heading in
+// that list.
+constexpr Vector headings[4] = { Vector(0,-1), Vector(1,0), Vector(0,1), Vector(-1,0) };
+
+constexpr int heading_index(const Vector &heading)
+{
+	return heading.y<0 ? 0 : heading.x>0 ? 1 : heading.y>0 ? 2 : 3;
+}
 int dig_random(Vector pos, Vector heading);
 int dig_room(Vector entrance, Vector heading);
 int dig_corridor(Vector entrance, Vector heading);
+int dig_cave(Vector entrance, Vector heading);
+int dig_prefab(Vector entrance, Vector heading);
+int area_is_clear(Vector corner, Vector heading, Vector size, Vector entrance);
 int is_in_bounds(Vector v);
 int is_in_bounds_or_border(Vector v);
 int is_known(Vector v);
@@ -81,51 +107,273 @@ void door_tile(Vector v);
 void fill_tile(Vector v);
 void permawall_tile(Vector v);
 int rand_range(int Min, int Max);
+int **alloc_grid(int width, int height);
+void init_map(int max_threads = 1);
+void free_map(int **g);
+void add_loops(int min_distance);
+double now_seconds(void);
+void trace(const char *name, double start, long arg = -1);
+
+
+enum { TILE_UNKNOWN, TILE_FLOOR, TILE_WALL, TILE_PERMAWALL, TILE_DOOR, NUM_TILES };
+
+// What each kind of tile is like. The predicates below test these flags
+// rather than listing tile types, so a new kind of tile only needs a row
+// here, and a loop over a row of tiles can test several properties with
+// one lookup.
+enum {
+	TF_BLOCKS    = 1,   // Solid: can't be walked through, and can be built over
+	TF_DIGGABLE  = 2,   // Can be dug out into floor
+	TF_PERMANENT = 4,   // Must never be dug through
+	TF_DOOR      = 8,
+	TF_KNOWN     = 16,  // Placed by a feature, as opposed to untouched rock
+	TF_FLOOR     = 32,
+};
+const uint8_t tile_flags[NUM_TILES] = {
+	/* TILE_UNKNOWN   */ TF_BLOCKS | TF_DIGGABLE,
+	/* TILE_FLOOR     */ TF_KNOWN | TF_FLOOR,
+	/* TILE_WALL      */ TF_KNOWN | TF_BLOCKS | TF_DIGGABLE,
+	/* TILE_PERMAWALL */ TF_KNOWN | TF_BLOCKS | TF_PERMANENT,
+	/* TILE_DOOR      */ TF_KNOWN | TF_DOOR,
+};
+
+// How each kind of tile is shown in printed maps and map files.
+const char tile_chars[NUM_TILES] = { ' ', '.', '#', '#', '+' };
+
+// Whether #tile has all of #flags.
+inline bool tile_has(int tile, int flags)
+{
+	return (tile_flags[tile] & flags) == flags;
+}
+
+// The map being dug and everything that goes with it are per thread, so
+// that -candidates can dig several maps at once.
+thread_local int **grid;
+thread_local unsigned rng_state;
+
+// A map is one block of cells with a table of row pointers into it, from
+// alloc_grid(). Blocks of 2MB or more are aligned to 2MB and marked for
+// transparent huge pages, so digging across a 16k x 16k map takes a few
+// hundred TLB entries rather than a quarter of a million. Only -pagebench
+// turns huge_pages off, to compare.
+const size_t huge_page = 2<<20;
+bool huge_pages = true;
+
+// With -strips, each thread digs a vertical strip of the map, and with
+// -region digging is confined to a rectangle. These are the columns and
+// rows of the borders around the part being dug.
+thread_local int bounds_left = 0, bounds_right = INT_MAX;
+thread_local int bounds_top = 0, bounds_bottom = INT_MAX;
 
+// With -extend, the old map is the rectangle from the origin to
+// (frozen_x, frozen_y), and it's out of bounds apart from its last row and
+// column, which new features can use as their border.
+int frozen_x = 0, frozen_y = 0;
 
-enum { TILE_UNKNOWN, TILE_FLOOR, TILE_WALL, TILE_PERMAWALL, TILE_DOOR };
-int **grid;
 int size_x, size_y;
 const int max_tries = 5;
 
+// The kinds of feature dig_random() picks from. Rooms and corridors are
+// always available; main() appends the optional ones.
+typedef int (*feature_func)(Vector entrance, Vector heading);
+std::vector<feature_func> features;
+std::vector<const char*> feature_names;
 
+// Per-feature measurements for -bench. When set, dig_random() times every
+// feature call and reads the hardware counters around it.
+class FeatureStats;
+std::vector<FeatureStats> *feature_stats;
+void measure_feature(int which, Vector pos, Vector heading, int &success);
+
+
+// A place where something could be dug, heading away from what's already
+// there. The frontier can hold a very large number of these, so they're
+// packed into 8 bytes: the location as an index into the map, and the
+// heading and door flag in the low bits of a second word.
 class Doorway
 {
 public:
-	Doorway(Vector l, Vector h, bool door) { location=l; heading=h; has_door=door; }
-	Vector location, heading;
-	bool has_door;
+	Doorway(Vector l, Vector h, bool door)
+		: position(l.y*size_x + l.x), flags(heading_index(h) | (door ? 4 : 0)) { }
+	
+	Vector location() const { return Vector(position % size_x, position / size_x); }
+	Vector heading()  const { return headings[flags & 3]; }
+	bool has_door()   const { return flags & 4; }
+	
+private:
+	uint32_t position;
+	uint8_t flags;
 };
-std::vector<Doorway> doorways;
+static_assert(sizeof(Doorway) <= 8, "Doorway should pack into 8 bytes");
+thread_local std::vector<Doorway> doorways;
 
+// If set, dig_loop() calls this once it has taken first_checkpoint doorways
+// and again each time that count doubles, with the number of checkpoints
+// passed so far, and stops if it returns false.
+thread_local bool (*dig_checkpoint)(int index);
+thread_local int first_checkpoint;
 
-void dig_loop(void)
+
+//
+// Event log. With -record, every successful operation (a feature placed, a
+// door set) is written to a file as it happens, so the map can be rebuilt
+// later by -replay without any random numbers or footprint checks. Each
+// record is a type byte with the heading in its high bits, the change in
+// position since the previous record as a zigzag varint, and then the
+// feature's parameters as varints.
+//
+enum { EVENT_END, EVENT_ROOM, EVENT_CORRIDOR, EVENT_CAVE, EVENT_PREFAB,
+       EVENT_DOOR, EVENT_DIG, EVENT_FILL };
+const char *event_names[] = { "end", "room", "corridor", "cave", "prefab",
+                              "door", "dig", "fill" };
+FILE *event_log;
+thread_local int event_log_position;
+
+void log_varint(unsigned value)
+{
+	if(!event_log)
+		return;
+	while(value >= 0x80) {
+		putc((value & 0x7f) | 0x80, event_log);
+		value >>= 7;
+	}
+	putc(value, event_log);
+}
+
+void log_event(int type, Vector pos, Vector heading)
 {
-	Vector entrance = Vector(size_x/2, size_y-1);
-	doorways.push_back(Doorway(entrance, Vector(0, -1), true));
+	if(!event_log)
+		return;
+	int position = pos.y*size_x + pos.x;
+	int delta = position - event_log_position;
 	
-	door_tile(entrance);
-	fill_tile(entrance+Vector(1, 0));
-	fill_tile(entrance-Vector(1, 0));
+	putc(type | heading_index(heading)<<4, event_log);
+	log_varint((unsigned)(delta<<1) ^ (unsigned)(delta>>31));
+	event_log_position = position;
+}
+
+void log_header(void)
+{
+	fputs("DLOG", event_log);
+	log_varint(size_x);
+	log_varint(size_y);
+}
+
+void log_end(void)
+{
+	putc(EVENT_END, event_log);
+}
+
+
+// Where digging starts, from -entrance. A point on the edge of the map is a
+// door in the outer wall; a point inside it gets doorways heading in all
+// four directions. With none given, there's one entrance in the middle of
+// the bottom edge.
+std::vector<Vector> seed_points;
+
+// The way digging heads from a seed point: inward from a door on the edge
+// of the map, or (0,0) from a point inside it.
+Vector seed_heading(Vector pos)
+{
+	return pos.y==size_y-1 ? Vector(0, -1) : pos.y==0 ? Vector(0, 1)
+	     : pos.x==size_x-1 ? Vector(-1, 0) : pos.x==0 ? Vector(1, 0) : Vector(0, 0);
+}
+
+// Whether this thread can dig from a seed point: the cell it opens onto
+// has to be inside the part of the map being dug, not on its border. From a
+// strip's border column no feature fits, and an entrance's side walls would
+// land in the next strip.
+bool can_seed(Vector pos)
+{
+	return is_in_bounds(pos + seed_heading(pos));
+}
+
+void seed_frontier(Vector pos)
+{
+	Vector heading = seed_heading(pos);
+	
+	if(heading == Vector(0, 0))
+	{
+		for(int ii=0; ii<4; ii++)
+			doorways.push_back(Doorway(pos, headings[ii], true));
+		return;
+	}
 	
-	while(doorways.size() > 0)
+	doorways.push_back(Doorway(pos, heading, true));
+	
+	log_event(EVENT_DOOR, pos, heading);
+	door_tile(pos);
+	log_event(EVENT_FILL, pos+heading.right(), heading);
+	fill_tile(pos+heading.right());
+	log_event(EVENT_FILL, pos+heading.left(), heading);
+	fill_tile(pos+heading.left());
+}
+
+// Start from every seed point this thread can dig from. The doorways they
+// add all go in the same frontier, so their growth is interleaved.
+void seed_entrances(void)
+{
+	for(size_t ii=0; ii<seed_points.size(); ii++)
+		if(can_seed(seed_points[ii]))
+			seed_frontier(seed_points[ii]);
+}
+
+// Put a doorway on every wall or door that has floor behind it and undug
+// rock in front, and on every door in the map's outer wall that opens onto
+// undug rock, so digging can carry on from a map that's already been dug.
+// Only cells in columns x0..x1-1 and rows y0..y1-1 are looked at.
+void rebuild_frontier(int x0 = 0, int y0 = 0, int x1 = INT_MAX, int y1 = INT_MAX)
+{
+	for(int yi=std::max(y0, 0); yi<std::min(y1, size_y); yi++)
+	for(int xi=std::max(x0, 0); xi<std::min(x1, size_x); xi++)
+	{
+		if(grid[yi][xi] != TILE_WALL && grid[yi][xi] != TILE_DOOR)
+			continue;
+		Vector pos(xi, yi), inward = seed_heading(pos);
+		if(inward == Vector(0, 0)) {
+			for(int ii=0; ii<4; ii++)
+				if(is_floor(pos-headings[ii]) && !is_known(pos+headings[ii]))
+					doorways.push_back(Doorway(pos, headings[ii], true));
+		}
+		else if(grid[yi][xi] == TILE_DOOR && !is_known(pos+inward))
+			doorways.push_back(Doorway(pos, inward, true));
+	}
+}
+
+void dig_loop(void)
+{
+	int next_checkpoint = first_checkpoint, checkpoint = 0;
+	for(int taken=1; doorways.size() > 0; taken++)
 	{
+		if(dig_checkpoint && taken == next_checkpoint) {
+			next_checkpoint *= 2;
+			if(!dig_checkpoint(checkpoint++)) {
+				doorways.clear();
+				break;
+			}
+		}
+		
+		// Take out a random doorway, moving the last one into its place
 		int which = rand_range(0, doorways.size()-1);
 		Doorway door = doorways[which];
-		doorways.erase(doorways.begin()+which);
+		doorways[which] = doorways.back();
+		doorways.pop_back();
 		
-		if(dig_random(door.location, door.heading))
+		if(dig_random(door.location(), door.heading()))
 		{
-			if(door.has_door)
-				door_tile(door.location);
-			else if(is_wall(door.location))
-				dig_tile(door.location);
+			if(door.has_door()) {
+				log_event(EVENT_DOOR, door.location(), door.heading());
+				door_tile(door.location());
+			} else if(is_wall(door.location())) {
+				log_event(EVENT_DIG, door.location(), door.heading());
+				dig_tile(door.location());
+			}
 		}
 	}
 }
 
-// Dig either a room or a corridor. Retry until something fits, or max_tries
-// times total.
+// Dig a room, a corridor or one of the optional features. Retry until
+// something fits, or max_tries times total.
 int dig_random(Vector pos, Vector heading)
 {
 	int success = 0;
@@ -133,57 +381,49 @@ int dig_random(Vector pos, Vector heading)
 	
 	for(tries=0; tries<max_tries; tries++)
 	{
-		switch( rand_range(0, 1) ) {
-			default:
-			case 0: success = dig_room         (pos, heading); break;
-			case 1: success = dig_corridor     (pos, heading); break;
-		}
+		int which = rand_range(0, features.size()-1);
+		if(feature_stats)
+			measure_feature(which, pos, heading, success);
+		else
+			success = features[which](pos, heading);
 		if(success)
 			return 1;
 	}
 	return 0;
 }
 
-// Dig a randomly sized room with an entrance at #entrance, facing in the
-// direction given by #heading. If it doesn't fit, return 0 without changing
-// anything. If it does fit, try to place more connected to the room as well.
-int dig_room(Vector entrance, Vector heading)
+// Check that a rectangle of #size tiles, starting at #corner and laid out
+// with rows along heading.right() and columns along #heading, is in bounds
+// and hasn't been dug yet (apart from #entrance, which may already be a door).
+int area_is_clear(Vector corner, Vector heading, Vector size, Vector entrance)
 {
-	Vector size;
-	Vector pos, corner;
-	Vector door_pos;
-	int entrance_offset;
-	
-	// ########
-	// #......# ^
-	// #......# |size.y
-	// #......# |
-	// #......# v
-	// C####.##
-	//  <---->
-	//  size.x
-	// <---->
-	// entrance_offset
-	
-	size.x = rand_range(3, 6);
-	size.y = rand_range(3, 6);
-	entrance_offset = rand_range(1, size.x);
-	
-	corner = entrance + (heading.left()*entrance_offset);
+	Vector pos = corner;
 	
-	// Check the area to see if any of it has already been dug
-	pos=corner;
-	for(int yi=0; yi<size.y+2; yi++) {
-		for(int xi=0; xi<size.x+2; xi++) {
+	for(int yi=0; yi<size.y; yi++) {
+		for(int xi=0; xi<size.x; xi++) {
 			if(!is_in_bounds_or_border(pos))
 				return 0;
 			if(!is_wall(pos) && pos!=entrance)
 				return 0;
 			pos += heading.right();
 		}
-		pos -= heading.right()*(size.x+2);
+		pos -= heading.right()*size.x;
 		pos += heading;
 	}
+	return 1;
+}
+
+// Build the room dig_room() has checked: fill its area with rock, dig out
+// the inside and put a door at #entrance.
+void stamp_room(Vector entrance, Vector heading, Vector size, int entrance_offset)
+{
+	Vector corner = entrance + (heading.left()*entrance_offset);
+	Vector pos;
+	
+	log_event(EVENT_ROOM, entrance, heading);
+	log_varint(size.x);
+	log_varint(size.y);
+	log_varint(entrance_offset);
 	
 	// Fill the whole area with rock
 	pos=corner;
@@ -216,6 +456,40 @@ int dig_room(Vector entrance, Vector heading)
 	
 	// Make the entrance a door
 	door_tile(entrance);
+}
+
+// Dig a randomly sized room with an entrance at #entrance, facing in the
+// direction given by #heading. If it doesn't fit, return 0 without changing
+// anything. If it does fit, try to place more connected to the room as well.
+int dig_room(Vector entrance, Vector heading)
+{
+	Vector size;
+	Vector corner;
+	Vector door_pos;
+	int entrance_offset;
+	
+	// ########
+	// #......# ^
+	// #......# |size.y
+	// #......# |
+	// #......# v
+	// C####.##
+	//  <---->
+	//  size.x
+	// <---->
+	// entrance_offset
+	
+	size.x = rand_range(3, 6);
+	size.y = rand_range(3, 6);
+	entrance_offset = rand_range(1, size.x);
+	
+	corner = entrance + (heading.left()*entrance_offset);
+	
+	// Check the area to see if any of it has already been dug
+	if(!area_is_clear(corner, heading, size+Vector(2, 2), entrance))
+		return 0;
+	
+	stamp_room(entrance, heading, size, entrance_offset);
 	
 	// Left wall connection
 	door_pos = corner + heading*rand_range(1, size.y);
@@ -230,6 +504,50 @@ int dig_room(Vector entrance, Vector heading)
 	return 1;
 }
 
+// Dig the corridor dig_corridor() has checked, up to #length tiles from
+// #entrance. Put the position of its last tile in #end, and return whether
+// that end had to be sealed off because it wasn't connected to anything.
+bool stamp_corridor(Vector entrance, Vector heading, int length, Vector &end)
+{
+	Vector pos;
+	Vector left_pos, right_pos;
+	bool sealed;
+	
+	log_event(EVENT_CORRIDOR, entrance, heading);
+	log_varint(length);
+	
+	pos       = entrance;
+	left_pos  = entrance + heading.left();
+	right_pos = entrance + heading.right();
+	
+	for(int ii=0; ii<length; ii++)
+	{
+		pos       += heading;
+		left_pos  += heading;
+		right_pos += heading;
+		
+		dig_tile(pos);
+		fill_tile(left_pos);
+		fill_tile(right_pos);
+		
+		if(!is_in_bounds(pos+heading))
+			break;
+		if(!is_wall(pos+heading))
+			break;
+	}
+	
+	sealed = !is_in_bounds(pos+heading) || is_wall(pos+heading);
+	if(sealed) {
+		// Seal off the end
+		fill_tile(pos);
+	} else {
+		// Put a doorway at the end
+		door_tile(pos);
+	}
+	end = pos;
+	return sealed;
+}
+
 int dig_corridor(Vector entrance, Vector heading)
 {
 	int length = rand_range(2, 6);
@@ -274,34 +592,9 @@ int dig_corridor(Vector entrance, Vector heading)
 		return 0;
 	
 	// Dig the corridor
-	pos       = entrance;
-	left_pos  = entrance + heading.left();
-	right_pos = entrance + heading.right();
-	
-	for(ii=0; ii<length; ii++)
-	{
-		pos       += heading;
-		left_pos  += heading;
-		right_pos += heading;
-		
-		dig_tile(pos);
-		fill_tile(left_pos);
-		fill_tile(right_pos);
-		
-		if(!is_in_bounds(pos+heading))
-			break;
-		if(!is_wall(pos+heading))
-			break;
-	}
-	
-	if(!is_in_bounds(pos+heading) || is_wall(pos+heading)) {
-		// If not connected to anything
-		// Seal off the end (it'll turn into a door when connected)
-		fill_tile(pos);
+	if(stamp_corridor(entrance, heading, length, pos)) {
+		// If not connected to anything, it'll turn into a door when it is
 		doorways.push_back(Doorway(pos, heading, false));
-	} else {
-		// Put a doorway at the end
-		door_tile(pos);
 	}
 	
 //	// Put something at the end, or, if that fails, seal off the dead end.
@@ -311,99 +604,2462 @@ int dig_corridor(Vector entrance, Vector heading)
 	return 1;
 }
 
+// Dig an organic, cave-like room with an entrance at #entrance, facing in
+// the direction given by #heading. The footprint is laid out like dig_room's,
+// but its inside is the result of running the cave automaton (see
+// Caves/Cave.c) on a small local buffer; only the part connected to the
+// entrance is kept. If it doesn't fit, or too little of it is reachable,
+// return 0 without changing anything.
+const int cave_max_size = 14;
+thread_local int cave_buf [cave_max_size+2][cave_max_size+2];
+thread_local int cave_buf2[cave_max_size+2][cave_max_size+2];
 
-int is_in_bounds(Vector v)
-{
-	return v.x>=1 && v.y>=1 && v.x<size_x-1 && v.y<size_y-1;
-}
-int is_in_bounds_or_border(Vector v)
-{
-	return v.x>=0 && v.y>=0 && v.x<size_x && v.y<size_y;
-}
-
-int is_known(Vector v) {
-	return grid[v.y][v.x] != TILE_UNKNOWN;
-}
-int is_floor(Vector v) {
-	return grid[v.y][v.x] == TILE_FLOOR;
-}
-int is_wall(Vector v) {
-	return grid[v.y][v.x] == TILE_WALL
-	    || grid[v.y][v.x] == TILE_UNKNOWN
-	    || grid[v.y][v.x] == TILE_PERMAWALL;
-}
-int is_permawall(Vector v) {
-	return grid[v.y][v.x] == TILE_PERMAWALL;
-}
-void dig_tile(Vector v) {
-	grid[v.y][v.x] = TILE_FLOOR;
-}
-void door_tile(Vector v) {
-	grid[v.y][v.x] = TILE_DOOR;
-}
-void fill_tile(Vector v) {
-	grid[v.y][v.x] = TILE_WALL;
-}
-void permawall_tile(Vector v) {
-	grid[v.y][v.x] = TILE_PERMAWALL;
-}
-
-
-// Return a random number between Min and Max.
-int rand_range(int Min, int Max)
-{
-	return rand() % (Max-Min+1) + Min;
-}
-
-
-void init_map(void)
-{
-	int xi, yi;
-	
-	grid = new int*[size_y];
-	
-	for(yi=0; yi<size_y; yi++)
-		grid[yi] = new int[size_x];
-	
-	for(yi=0; yi<size_y; yi++)
-	for(xi=0; xi<size_x; xi++)
-		grid[yi][xi] = TILE_UNKNOWN;
-}
-
-
-void print_map(void)
+void cave_generation(Vector size, int r1_cutoff, int r2_cutoff)
 {
-	for(int yi=0; yi<size_y; yi++)
+	for(int yi=1; yi<=size.y; yi++)
+	for(int xi=1; xi<=size.x; xi++)
 	{
-		for(int xi=0; xi<size_x; xi++)
+		int adjcount_r1 = 0,
+		    adjcount_r2 = 0;
+		
+		for(int ii=yi-2; ii<=yi+2; ii++)
+		for(int jj=xi-2; jj<=xi+2; jj++)
 		{
-			switch(grid[yi][xi]) {
-				case TILE_UNKNOWN:   putchar(' '); break;
-				case TILE_FLOOR:     putchar('.'); break;
-				case TILE_WALL:      putchar('#'); break;
-				case TILE_PERMAWALL: putchar('#'); break;
-				case TILE_DOOR:      putchar('+'); break;
+			if(abs(ii-yi)==2 && abs(jj-xi)==2)
+				continue;
+			if(ii<0 || jj<0 || ii>size.y+1 || jj>size.x+1)
+				continue;
+			if(cave_buf[ii][jj]) {
+				adjcount_r2++;
+				if(abs(ii-yi)<=1 && abs(jj-xi)<=1)
+					adjcount_r1++;
 			}
 		}
-		putchar('\n');
+		cave_buf2[yi][xi] = adjcount_r1 >= r1_cutoff || adjcount_r2 <= r2_cutoff;
 	}
+	for(int yi=1; yi<=size.y; yi++)
+		memcpy(&cave_buf[yi][1], &cave_buf2[yi][1], sizeof(int)*size.x);
 }
 
-int main(int argc, char **argv)
+// Build the cave room dig_cave() has checked: fill its area with rock, then
+// dig out the cells of cave_buf that are marked 2 and put a door at
+// #entrance.
+void stamp_cave(Vector entrance, Vector heading, Vector size, int entrance_offset)
 {
-	if(argc < 3) {
-		printf("Usage: %s xsize ysize\n", argv[0]);
-		return 1;
-	}
-	size_x     = atoi(argv[1]);
-	size_y     = atoi(argv[2]);
+	Vector corner = entrance + (heading.left()*entrance_offset);
+	Vector pos;
 	
-	srand(time(NULL));
-	init_map();
+	log_event(EVENT_CAVE, entrance, heading);
+	log_varint(size.x);
+	log_varint(size.y);
+	log_varint(entrance_offset);
+	for(int yi=1; yi<=size.y; yi++)
+	{
+		unsigned bits = 0;
+		for(int xi=1; xi<=size.x; xi++)
+			bits |= (cave_buf[yi][xi] == 2) << (xi-1);
+		log_varint(bits);
+	}
 	
-	dig_loop();
+	// Fill the whole area with rock, then dig out the reachable part
+	pos=corner;
+	for(int yi=0; yi<size.y+2; yi++) {
+		for(int xi=0; xi<size.x+2; xi++) {
+			if(cave_buf[yi][xi] == 2)
+				dig_tile(pos);
+			else
+				fill_tile(pos);
+			pos += heading.right();
+		}
+		pos -= heading.right()*(size.x+2);
+		pos += heading;
+	}
 	
+	// Make the entrance a door
+	door_tile(entrance);
+}
+
+int dig_cave(Vector entrance, Vector heading)
+{
+	Vector size;
+	Vector corner;
+	Vector door_pos;
+	int entrance_offset;
+	int reached;
+	
+	size.x = rand_range(6, cave_max_size);
+	size.y = rand_range(6, cave_max_size);
+	entrance_offset = rand_range(1, size.x);
+	
+	corner = entrance + (heading.left()*entrance_offset);
+	
+	// Check the area to see if any of it has already been dug
+	if(!area_is_clear(corner, heading, size+Vector(2, 2), entrance))
+		return 0;
+	
+	// Run the automaton in local coordinates: x along heading.right(), y
+	// along heading, with the entrance at (entrance_offset, 0). The outer
+	// ring is the room's wall and never changes.
+	for(int yi=0; yi<size.y+2; yi++)
+	for(int xi=0; xi<size.x+2; xi++)
+	{
+		if(yi==0 || xi==0 || yi==size.y+1 || xi==size.x+1)
+			cave_buf[yi][xi] = 1;
+		else
+			cave_buf[yi][xi] = rand_range(0, 99) < 40;
+	}
+	for(int ii=0; ii<3; ii++)
+		cave_generation(size, 5, 2);
+	for(int ii=0; ii<2; ii++)
+		cave_generation(size, 5, -1);
+	
+	// Keep only what's reachable from just inside the entrance. Reached
+	// cells are marked 2 and everything else becomes wall.
+	cave_buf[1][entrance_offset] = 2;
+	reached = 0;
+	{
+		std::vector<Vector> stack;
+		stack.push_back(Vector(entrance_offset, 1));
+		while(stack.size() > 0)
+		{
+			Vector p = stack.back();
+			stack.pop_back();
+			reached++;
+			
+			for(int ii=0; ii<4; ii++) {
+				Vector q = p + headings[ii];
+				if(cave_buf[q.y][q.x] == 0) {
+					cave_buf[q.y][q.x] = 2;
+					stack.push_back(q);
+				}
+			}
+		}
+	}
+	if(reached < size.x*size.y/3)
+		return 0;
+	
+	// Find the spots on the other three walls that have open cave behind
+	// them. A cave that reaches none of them would be a dead end, and if it's
+	// the first feature the map would stop there, so leave the area alone.
+	std::vector<int> left_spots, far_spots, right_spots;
+	for(int yi=1; yi<=size.y; yi++)
+		if(cave_buf[yi][1] == 2)
+			left_spots.push_back(yi);
+	for(int xi=1; xi<=size.x; xi++)
+		if(cave_buf[size.y][xi] == 2)
+			far_spots.push_back(xi);
+	for(int yi=1; yi<=size.y; yi++)
+		if(cave_buf[yi][size.x] == 2)
+			right_spots.push_back(yi);
+	if(left_spots.empty() && far_spots.empty() && right_spots.empty())
+		return 0;
+	
+	stamp_cave(entrance, heading, size, entrance_offset);
+	
+	// Put a connection at a random one of those spots on each wall that has
+	// any, so there's at least one way on.
+	if(left_spots.size() > 0) {
+		door_pos = corner + heading*left_spots[rand_range(0, left_spots.size()-1)];
+		doorways.push_back(Doorway(door_pos, heading.left(), true));
+	}
+	if(far_spots.size() > 0) {
+		door_pos = corner + heading*(size.y+1) + heading.right()*far_spots[rand_range(0, far_spots.size()-1)];
+		doorways.push_back(Doorway(door_pos, heading, true));
+	}
+	if(right_spots.size() > 0) {
+		door_pos = corner + heading.right()*(size.x+1) + heading*right_spots[rand_range(0, right_spots.size()-1)];
+		doorways.push_back(Doorway(door_pos, heading.right(), true));
+	}
+	
+	return 1;
+}
+
+
+//
+// Prefab rooms are hand-drawn shapes loaded from a file. Each one is drawn
+// with '#' for wall, '.' for floor and '+' for a door anchor on its outline;
+// spaces are not part of the prefab. Prefabs are separated by blank lines
+// and lines starting with ';' are comments:
+//
+//    ; A small cross-shaped room
+//     #+#
+//    ##.##
+//    +...+
+//    ##.##
+//     #+#
+//
+// All four rotations of every prefab are built at load time, so placing one
+// is a table lookup followed by a footprint check over its occupancy masks.
+//
+const int prefab_max_size = 64;
+
+class Prefab
+{
+public:
+	int width, height;
+	std::vector<uint64_t> occupied;  // Per row, bit xi set if (xi,row) is part of the prefab
+	std::vector<uint64_t> floor;     // Per row, the subset of #occupied that is dug out
+	std::vector<Vector> anchors;     // Door anchors, relative to the top-left corner
+	std::vector<Vector> anchor_headings; // Direction pointing out of the prefab at each anchor
+};
+std::vector<Prefab> prefabs;
+
+// For each heading, every (prefab, anchor) pair whose anchor points out of
+// the prefab in that heading. Indexed by heading_index().
+std::vector<std::pair<int,int> > prefab_anchors[4];
+
+// Turn one drawing into a Prefab, or return false if it's malformed.
+bool build_prefab(const std::vector<std::string> &rows, Prefab &prefab)
+{
+	prefab.height = rows.size();
+	prefab.width = 0;
+	for(int yi=0; yi<prefab.height; yi++)
+		if((int)rows[yi].size() > prefab.width)
+			prefab.width = rows[yi].size();
+	if(prefab.width > prefab_max_size || prefab.height > prefab_max_size)
+		return false;
+	
+	#define PREFAB_CELL(x,y) ((x)>=0 && (y)>=0 && (y)<prefab.height && (x)<(int)rows[y].size() ? rows[y][x] : ' ')
+	prefab.occupied.assign(prefab.height, 0);
+	prefab.floor.assign(prefab.height, 0);
+	for(int yi=0; yi<prefab.height; yi++)
+	for(int xi=0; xi<prefab.width; xi++)
+	{
+		char c = PREFAB_CELL(xi, yi);
+		if(c == ' ')
+			continue;
+		prefab.occupied[yi] |= (uint64_t)1 << xi;
+		
+		if(c == '.') {
+			prefab.floor[yi] |= (uint64_t)1 << xi;
+			// Floor must be fully enclosed by the prefab itself
+			for(int ii=-1; ii<=1; ii++)
+			for(int jj=-1; jj<=1; jj++)
+				if(PREFAB_CELL(xi+jj, yi+ii) == ' ')
+					return false;
+		} else if(c == '+') {
+			// An anchor has floor on one side and the outside on the other
+			int dir;
+			for(dir=0; dir<4; dir++) {
+				Vector out = Vector(xi, yi) + headings[dir];
+				Vector in  = Vector(xi, yi) - headings[dir];
+				if(PREFAB_CELL(out.x, out.y) == ' ' && PREFAB_CELL(in.x, in.y) == '.')
+					break;
+			}
+			if(dir == 4)
+				return false;
+			prefab.anchors.push_back(Vector(xi, yi));
+			prefab.anchor_headings.push_back(headings[dir]);
+		} else if(c != '#') {
+			return false;
+		}
+	}
+	#undef PREFAB_CELL
+	return prefab.anchors.size() > 0;
+}
+
+// Rotate a drawing 90 degrees clockwise.
+std::vector<std::string> rotate_drawing(const std::vector<std::string> &rows)
+{
+	size_t width = 0;
+	for(size_t yi=0; yi<rows.size(); yi++)
+		if(rows[yi].size() > width)
+			width = rows[yi].size();
+	
+	std::vector<std::string> rotated(width, std::string(rows.size(), ' '));
+	for(size_t yi=0; yi<rows.size(); yi++)
+	for(size_t xi=0; xi<rows[yi].size(); xi++)
+		rotated[xi][rows.size()-1-yi] = rows[yi][xi];
+	return rotated;
+}
+
+void add_prefab(const std::vector<std::string> &rows, const char *filename, int line)
+{
+	std::vector<std::string> drawing = rows;
+	
+	for(int rotation=0; rotation<4; rotation++)
+	{
+		Prefab prefab;
+		if(!build_prefab(drawing, prefab)) {
+			fprintf(stderr, "%s:%i: Malformed prefab, skipping.\n", filename, line);
+			return;
+		}
+		prefabs.push_back(prefab);
+		for(size_t ii=0; ii<prefab.anchors.size(); ii++)
+			prefab_anchors[heading_index(prefab.anchor_headings[ii])].push_back(
+				std::make_pair((int)prefabs.size()-1, (int)ii));
+		drawing = rotate_drawing(drawing);
+	}
+}
+
+// Load every prefab in #filename. Return the number loaded, or -1 if the file
+// couldn't be read.
+int load_prefabs(const char *filename)
+{
+	FILE *fin = fopen(filename, "r");
+	char line_inbuf[prefab_max_size+3];
+	std::vector<std::string> rows;
+	int line = 0, start_line = 0;
+	size_t loaded = prefabs.size();
+	
+	if(!fin)
+		return -1;
+	
+	while(fgets(line_inbuf, sizeof line_inbuf, fin))
+	{
+		line++;
+		line_inbuf[strcspn(line_inbuf, "\r\n")] = 0;
+		if(line_inbuf[0] == ';')
+			continue;
+		if(line_inbuf[0] == 0) {
+			if(rows.size() > 0)
+				add_prefab(rows, filename, start_line);
+			rows.clear();
+			continue;
+		}
+		if(rows.size() == 0)
+			start_line = line;
+		rows.push_back(line_inbuf);
+	}
+	if(rows.size() > 0)
+		add_prefab(rows, filename, start_line);
+	fclose(fin);
+	
+	return (prefabs.size()-loaded) / 4;
+}
+
+// Check that every occupied cell of #prefab, placed with its top-left corner
+// at #origin, is in bounds and hasn't been dug yet (apart from #entrance).
+int prefab_is_clear(const Prefab &prefab, Vector origin, Vector entrance)
+{
+	for(int yi=0; yi<prefab.height; yi++)
+	{
+		uint64_t mask = prefab.occupied[yi];
+		while(mask)
+		{
+			Vector pos = origin + Vector(__builtin_ctzll(mask), yi);
+			mask &= mask-1;
+			
+			if(!is_in_bounds_or_border(pos))
+				return 0;
+			if(!is_wall(pos) && pos!=entrance)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+// Build prefab #index, as checked by dig_prefab(), with its anchor #anchor
+// on #entrance, and make #entrance a door.
+void stamp_prefab(int index, int anchor, Vector entrance)
+{
+	const Prefab &prefab = prefabs[index];
+	Vector origin = entrance - prefab.anchors[anchor];
+	
+	log_event(EVENT_PREFAB, entrance, Vector(0, -1));
+	log_varint(index);
+	log_varint(anchor);
+	
+	for(int yi=0; yi<prefab.height; yi++)
+	{
+		uint64_t mask = prefab.occupied[yi];
+		while(mask)
+		{
+			int xi = __builtin_ctzll(mask);
+			mask &= mask-1;
+			
+			if(prefab.floor[yi] & ((uint64_t)1 << xi))
+				dig_tile(origin + Vector(xi, yi));
+			else
+				fill_tile(origin + Vector(xi, yi));
+		}
+	}
+	door_tile(entrance);
+}
+
+// Place a random prefab, in a random rotation, so that one of its door
+// anchors lands on #entrance. If it doesn't fit, return 0 without changing
+// anything. Its other anchors become doorways.
+int dig_prefab(Vector entrance, Vector heading)
+{
+	const std::vector<std::pair<int,int> > &candidates =
+		prefab_anchors[heading_index(Vector(0,0)-heading)];
+	
+	if(candidates.size() == 0)
+		return 0;
+	
+	const std::pair<int,int> &pick = candidates[rand_range(0, candidates.size()-1)];
+	const Prefab &prefab = prefabs[pick.first];
+	Vector origin = entrance - prefab.anchors[pick.second];
+	
+	if(!prefab_is_clear(prefab, origin, entrance))
+		return 0;
+	
+	stamp_prefab(pick.first, pick.second, entrance);
+	
+	// Make the other anchors connections
+	for(size_t ii=0; ii<prefab.anchors.size(); ii++)
+	{
+		if((int)ii == pick.second)
+			continue;
+		doorways.push_back(Doorway(origin + prefab.anchors[ii], prefab.anchor_headings[ii], true));
+	}
+	
+	return 1;
+}
+
+
+//
+// Loop insertion. The digger only ever connects a new feature to the one it
+// grew from, so the finished map is a tree. This pass labels every room and
+// corridor with a region ID, builds the graph of which regions share a door,
+// and then knocks doors through single walls between regions that are far
+// apart in that graph.
+//
+thread_local int **region;
+thread_local int num_regions;
+
+// The room graph, stored as one array of edges. Region n's neighbours are
+// graph_edges[graph_start[n] .. graph_end[n]); the slots up to
+// graph_start[n+1] are spare room for the doors add_loops() creates.
+thread_local std::vector<int> graph_start, graph_end, graph_edges;
+
+// Give every 4-connected area of floor its own region ID, starting at 1.
+// Doors and walls get region 0. Works on horizontal runs of floor: each run
+// gets a provisional label, runs that touch a run in the row above are
+// merged with union-find, and a second pass writes out the final IDs.
+int find_label(std::vector<int> &parent, int label)
+{
+	while(parent[label] != label)
+		label = parent[label] = parent[parent[label]];
+	return label;
+}
+
+void label_regions(void)
+{
+	std::vector<int> parent(1, 0);
+	
+	if(!region) {
+		region = alloc_grid(size_x, size_y);
+	}
+	
+	for(int yi=0; yi<size_y; yi++)
+	{
+		const int *row = grid[yi];
+		int *labels = region[yi];
+		const int *above = yi>0 ? region[yi-1] : NULL;
+		
+		for(int xi=0; xi<size_x; )
+		{
+			if(row[xi] != TILE_FLOOR) {
+				labels[xi++] = 0;
+				continue;
+			}
+			
+			int label = parent.size();
+			parent.push_back(label);
+			for(int last=0; xi<size_x && row[xi]==TILE_FLOOR; xi++)
+			{
+				labels[xi] = label;
+				if(above && above[xi] && above[xi] != last) {
+					last = above[xi];
+					int a = find_label(parent, last),
+					    b = find_label(parent, label);
+					if(a < b) parent[b] = a;
+					else      parent[a] = b;
+				}
+			}
+		}
+	}
+	
+	// Number the roots in order, then relabel every tile
+	std::vector<int> final_label(parent.size(), 0);
+	num_regions = 0;
+	for(size_t ii=1; ii<parent.size(); ii++)
+	{
+		int root = find_label(parent, ii);
+		if(root == (int)ii)
+			final_label[ii] = ++num_regions;
+		else
+			final_label[ii] = final_label[root];
+	}
+	for(int yi=0; yi<size_y; yi++)
+	for(int xi=0; xi<size_x; xi++)
+		region[yi][xi] = final_label[region[yi][xi]];
+}
+
+// If the in-bounds tile at (#xi,#yi) is one tile thick between floor on two
+// opposite sides, with real wall on the other two, return the regions on
+// either side in #a and #b. Needs an up to date region layer.
+inline int separates_regions(int xi, int yi, int &a, int &b)
+{
+	const int *up = grid[yi-1], *row = grid[yi], *down = grid[yi+1];
+	
+	#define SOLID(t) tile_has(t, TF_KNOWN|TF_BLOCKS)
+	if(up[xi] == TILE_FLOOR && down[xi] == TILE_FLOOR
+	 && SOLID(row[xi-1]) && SOLID(row[xi+1])) {
+		a = region[yi-1][xi];
+		b = region[yi+1][xi];
+		return a != b;
+	}
+	if(row[xi-1] == TILE_FLOOR && row[xi+1] == TILE_FLOOR
+	 && SOLID(up[xi]) && SOLID(down[xi])) {
+		a = region[yi][xi-1];
+		b = region[yi][xi+1];
+		return a != b;
+	}
+	#undef SOLID
+	return 0;
+}
+
+// Return whether #to can be reached from #from in at most #max_steps steps
+// of the room graph. Searches from both ends at once, always growing the smaller
+// side, so each side only has to go about half the distance. #mark and
+// #stamp let repeated searches skip clearing.
+bool within_distance(int from, int to, int max_steps, std::vector<int> &mark, int stamp)
+{
+	static thread_local std::vector<int> side[2], next;
+	
+	if(from == to)
+		return true;
+	side[0].assign(1, from);
+	side[1].assign(1, to);
+	mark[from] = 2*stamp;
+	mark[to]   = 2*stamp+1;
+	
+	for(int step=0; step<max_steps; step++)
+	{
+		int grow = side[0].size() <= side[1].size() ? 0 : 1;
+		if(side[grow].size() == 0)
+			return false;
+		
+		next.clear();
+		for(size_t ii=0; ii<side[grow].size(); ii++)
+		{
+			int from = side[grow][ii];
+			for(int jj=graph_start[from]; jj<graph_end[from]; jj++)
+			{
+				int node = graph_edges[jj];
+				if(mark[node] == 2*stamp+1-grow)
+					return true;
+				if(mark[node] != 2*stamp+grow) {
+					mark[node] = 2*stamp+grow;
+					next.push_back(node);
+				}
+			}
+		}
+		side[grow].swap(next);
+	}
+	return false;
+}
+
+// Call #visit with the regions around each run of adjacent doors, each
+// region once. Doors next to each other pass through to one another, so a
+// run joins every region it touches, not just the two beside one door.
+// Needs an up to date region layer.
+template<typename Visit>
+void for_each_door_run(Visit visit)
+{
+	std::vector<char> seen((size_t)size_x * size_y, 0);
+	std::vector<Vector> run;
+	std::vector<int> labels;
+	
+	for(int yi=1; yi<size_y-1; yi++)
+	for(int xi=1; xi<size_x-1; xi++)
+	{
+		if(grid[yi][xi] != TILE_DOOR || seen[yi*size_x + xi])
+			continue;
+		
+		labels.clear();
+		run.assign(1, Vector(xi, yi));
+		seen[yi*size_x + xi] = 1;
+		for(size_t head=0; head<run.size(); head++)
+		for(int ii=0; ii<4; ii++)
+		{
+			Vector next = run[head] + headings[ii];
+			if(next.x<0 || next.y<0 || next.x>=size_x || next.y>=size_y)
+				continue;
+			int label = region[next.y][next.x];
+			if(label) {
+				if(std::find(labels.begin(), labels.end(), label) == labels.end())
+					labels.push_back(label);
+			}
+			else if(grid[next.y][next.x] == TILE_DOOR && !seen[next.y*size_x + next.x]) {
+				seen[next.y*size_x + next.x] = 1;
+				run.push_back(next);
+			}
+		}
+		visit(labels);
+	}
+}
+
+// Merge, in #parent, all the regions around each run of doors. Needs an up
+// to date region layer.
+void join_through_doors(std::vector<int> &parent)
+{
+	parent.resize(num_regions+1);
+	for(int ii=0; ii<=num_regions; ii++)
+		parent[ii] = ii;
+	
+	for_each_door_run([&](const std::vector<int> &labels) {
+		for(size_t ii=1; ii<labels.size(); ii++) {
+			int a = find_label(parent, labels[0]),
+			    b = find_label(parent, labels[ii]);
+			if(a < b) parent[b] = a;
+			else      parent[a] = b;
+		}
+	});
+}
+
+class LoopCandidate
+{
+public:
+	LoopCandidate(Vector p, int a, int b) { pos=p; this->a=a<b?a:b; this->b=a<b?b:a; }
+	Vector pos;
+	int a, b;
+	bool operator<(const LoopCandidate &other) const
+		{ return a!=other.a ? a<other.a : b<other.b; }
+};
+
+void add_graph_edge(int a, int b)
+{
+	graph_edges[graph_end[a]++] = b;
+	graph_edges[graph_end[b]++] = a;
+}
+
+// Add a door between every pair of adjacent regions that are more than
+// #min_distance doors apart, one pair at a time so that each new door
+// counts towards the distances after it.
+void add_loops(int min_distance)
+{
+	std::vector<LoopCandidate> candidates;
+	std::vector<std::pair<int,int> > doors;
+	std::vector<int> mark;
+	int a, b;
+	
+	label_regions();
+	
+	// The doors already in the map link every pair of regions around each
+	// run of them
+	for_each_door_run([&](const std::vector<int> &labels) {
+		for(size_t ii=0; ii<labels.size(); ii++)
+		for(size_t jj=ii+1; jj<labels.size(); jj++)
+			doors.push_back(std::make_pair(labels[ii], labels[jj]));
+	});
+	
+	// Find every wall that separates two different regions
+	for(int yi=1; yi<size_y-1; yi++)
+	for(int xi=1; xi<size_x-1; xi++)
+	{
+		if(grid[yi][xi] == TILE_WALL && separates_regions(xi, yi, a, b))
+			candidates.push_back(LoopCandidate(Vector(xi, yi), a, b));
+	}
+	
+	// Keep one randomly chosen wall per pair of regions
+	std::stable_sort(candidates.begin(), candidates.end());
+	size_t pairs = 0;
+	for(size_t ii=0; ii<candidates.size(); )
+	{
+		size_t end = ii;
+		while(end<candidates.size() && !(candidates[ii]<candidates[end]))
+			end++;
+		candidates[pairs++] = candidates[rand_range(ii, end-1)];
+		ii = end;
+	}
+	candidates.erase(candidates.begin()+pairs, candidates.end());
+	for(size_t ii=pairs; ii>1; ii--)
+		std::swap(candidates[ii-1], candidates[rand_range(0, ii-1)]);
+	
+	// Lay out the graph with room for every door that might be added
+	graph_start.assign(num_regions+2, 0);
+	for(size_t ii=0; ii<doors.size(); ii++) {
+		graph_start[doors[ii].first+1]++;
+		graph_start[doors[ii].second+1]++;
+	}
+	for(size_t ii=0; ii<candidates.size(); ii++) {
+		graph_start[candidates[ii].a+1]++;
+		graph_start[candidates[ii].b+1]++;
+	}
+	for(int ii=1; ii<=num_regions+1; ii++)
+		graph_start[ii] += graph_start[ii-1];
+	graph_end.assign(graph_start.begin(), graph_start.end()-1);
+	graph_edges.resize(graph_start[num_regions+1]);
+	for(size_t ii=0; ii<doors.size(); ii++)
+		add_graph_edge(doors[ii].first, doors[ii].second);
+	
+	mark.assign(num_regions+1, 0);
+	for(size_t ii=0; ii<candidates.size(); ii++)
+	{
+		LoopCandidate &candidate = candidates[ii];
+		
+		// An earlier door may have been put right next to this one
+		if(!separates_regions(candidate.pos.x, candidate.pos.y, a, b))
+			continue;
+		if(within_distance(candidate.a, candidate.b, min_distance, mark, ii+1))
+			continue;
+		
+		log_event(EVENT_DOOR, candidate.pos, Vector(0, -1));
+		door_tile(candidate.pos);
+		add_graph_edge(candidate.a, candidate.b);
+	}
+}
+
+
+// Several seeds, or several strips, grow into separate trees that only
+// meet at their walls. This joins them up, by putting doors through walls
+// one or two tiles thick between floor in different components, in random
+// order. Whatever is still cut off after that, behind thicker walls, gets a
+// tunnel to the nearest floor outside it, so the map always ends up as one
+// component. Walls are only opened, and tunnels only dug, within the bounds
+// being dug, which -region narrows to the rectangle and its ring.
+//
+class Opening
+{
+public:
+	Opening(Vector pos, Vector heading, int thickness, int a, int b)
+		: pos(pos), heading(heading), thickness(thickness), a(a), b(b) { }
+	Vector pos, heading;
+	int thickness;
+	int a, b;
+};
+
+// Dig the shortest tunnel through rock and walls from the tiles in #queue
+// to the nearest floor that isn't one of them, by a breadth-first search
+// from all of them at once. Rock along it becomes floor walled in all
+// round, and a wall it crosses becomes a door where it meets existing
+// floor, or floor in the middle of a thick wall or next to another door. With #labelled only floor
+// that label_regions() has numbered counts, so the caller can tell which
+// component was reached. Return the index of the tile reached, or -1 if
+// there's no way through.
+int dig_tunnel(std::vector<int> &queue, bool labelled)
+{
+	std::vector<int> from((size_t)size_x * size_y, -1);
+	int reached = -1;
+	
+	for(size_t ii=0; ii<queue.size(); ii++)
+		from[queue[ii]] = queue[ii];
+	for(size_t head=0; head<queue.size() && reached<0; head++)
+	{
+		Vector pos(queue[head] % size_x, queue[head] / size_x);
+		for(int ii=0; ii<4 && reached<0; ii++)
+		{
+			Vector next = pos + headings[ii];
+			if(next.x<0 || next.y<0 || next.x>=size_x || next.y>=size_y)
+				continue;
+			int index = next.y*size_x + next.x;
+			if(from[index] >= 0)
+				continue;
+			if(labelled ? region[next.y][next.x] != 0 : is_floor(next)) {
+				from[index] = queue[head];
+				reached = index;
+			}
+			else if(is_in_bounds(next) && !is_permawall(next) && grid[next.y][next.x] != TILE_DOOR) {
+				from[index] = queue[head];
+				queue.push_back(index);
+			}
+		}
+	}
+	if(reached < 0)
+		return -1;
+	
+	// Walk back from the floor that was reached to where the search started
+	for(int index=from[reached], last=reached; from[index] != index; last=index, index=from[index])
+	{
+		Vector pos(index % size_x, index / size_x);
+		Vector heading = Vector(last % size_x, last / size_x) - pos;
+		int start = from[index];
+		bool meets_floor = last == reached
+		                || (from[start] == start && is_floor(Vector(start % size_x, start / size_x)));
+		if(grid[pos.y][pos.x] == TILE_WALL && meets_floor && grid[last/size_x][last%size_x] != TILE_DOOR) {
+			log_event(EVENT_DOOR, pos, heading);
+			door_tile(pos);
+			continue;
+		}
+		log_event(EVENT_DIG, pos, heading);
+		dig_tile(pos);
+		for(int yi=-1; yi<=1; yi++)
+		for(int xi=-1; xi<=1; xi++)
+		{
+			Vector wall = pos + Vector(xi, yi);
+			if(!is_known(wall)) {
+				log_event(EVENT_FILL, wall, heading);
+				fill_tile(wall);
+			}
+		}
+	}
+	return reached;
+}
+
+// Tunnel from every component but the largest until they're all joined.
+// Strays may join each other first, so go round until nothing changes. The
+// searches are over the whole map, but they're only for what couldn't be
+// joined with a door, which is rare.
+void tunnel_strays(std::vector<int> &parent)
+{
+	std::vector<long> cells(num_regions+1, 0);
+	
+	for(int yi=0; yi<size_y; yi++)
+	for(int xi=0; xi<size_x; xi++)
+		if(region[yi][xi])
+			cells[find_label(parent, region[yi][xi])]++;
+	int largest = std::max_element(cells.begin(), cells.end()) - cells.begin();
+	
+	for(bool joined=true; joined; )
+	{
+		joined = false;
+		for(int comp=1; comp<=num_regions; comp++)
+		{
+			if(find_label(parent, comp) != comp || comp == find_label(parent, largest))
+				continue;
+			
+			std::vector<int> queue;
+			for(int yi=0; yi<size_y; yi++)
+			for(int xi=0; xi<size_x; xi++)
+				if(region[yi][xi] && find_label(parent, region[yi][xi]) == comp)
+					queue.push_back(yi*size_x + xi);
+			int reached = dig_tunnel(queue, true);
+			if(reached < 0)
+				continue;
+			
+			int other = find_label(parent, region[reached/size_x][reached%size_x]);
+			if(comp < other) parent[other] = comp;
+			else             parent[comp] = other;
+			joined = true;
+		}
+	}
+}
+
+void connect_components(void)
+{
+	std::vector<Opening> openings;
+	std::vector<int> parent;
+	int a, b;
+	
+	label_regions();
+	join_through_doors(parent);
+	
+	#define SOLID(t) tile_has(t, TF_KNOWN|TF_BLOCKS)
+	for(int yi=1; yi<size_y-1; yi++)
+	for(int xi=1; xi<size_x-1; xi++)
+	{
+		if(grid[yi][xi] != TILE_WALL || !is_in_bounds_or_border(Vector(xi, yi)))
+			continue;
+		if(separates_regions(xi, yi, a, b)) {
+			if(find_label(parent, a) != find_label(parent, b))
+				openings.push_back(Opening(Vector(xi, yi), Vector(1, 0), 1, a, b));
+			continue;
+		}
+		
+		// Two walls side by side, with floor beyond each and solid rock
+		// along both sides
+		if(xi+2 < size_x && grid[yi][xi+1] == TILE_WALL && is_in_bounds_or_border(Vector(xi+1, yi))
+		 && grid[yi][xi-1] == TILE_FLOOR && grid[yi][xi+2] == TILE_FLOOR
+		 && SOLID(grid[yi-1][xi]) && SOLID(grid[yi-1][xi+1])
+		 && SOLID(grid[yi+1][xi]) && SOLID(grid[yi+1][xi+1])
+		 && find_label(parent, region[yi][xi-1]) != find_label(parent, region[yi][xi+2]))
+			openings.push_back(Opening(Vector(xi, yi), Vector(1, 0), 2, region[yi][xi-1], region[yi][xi+2]));
+		if(yi+2 < size_y && grid[yi+1][xi] == TILE_WALL && is_in_bounds_or_border(Vector(xi, yi+1))
+		 && grid[yi-1][xi] == TILE_FLOOR && grid[yi+2][xi] == TILE_FLOOR
+		 && SOLID(grid[yi][xi-1]) && SOLID(grid[yi+1][xi-1])
+		 && SOLID(grid[yi][xi+1]) && SOLID(grid[yi+1][xi+1])
+		 && find_label(parent, region[yi-1][xi]) != find_label(parent, region[yi+2][xi]))
+			openings.push_back(Opening(Vector(xi, yi), Vector(0, 1), 2, region[yi-1][xi], region[yi+2][xi]));
+	}
+	#undef SOLID
+	
+	for(size_t ii=openings.size(); ii>1; ii--)
+		std::swap(openings[ii-1], openings[rand_range(0, ii-1)]);
+	
+	for(size_t ii=0; ii<openings.size(); ii++)
+	{
+		Opening &opening = openings[ii];
+		a = find_label(parent, opening.a);
+		b = find_label(parent, opening.b);
+		if(a == b)
+			continue;
+		if(a < b) parent[b] = a;
+		else      parent[a] = b;
+		
+		log_event(EVENT_DOOR, opening.pos, opening.heading);
+		door_tile(opening.pos);
+		if(opening.thickness == 2) {
+			log_event(EVENT_DIG, opening.pos+opening.heading, opening.heading);
+			dig_tile(opening.pos+opening.heading);
+		}
+	}
+	
+	tunnel_strays(parent);
+}
+
+// Dig the whole map from the seed points. With more than one strip, each
+// strip is dug on its own thread, from the seeds inside it, with its own
+// random numbers drawn from this thread's. Then the gaps between the strips
+// are dug from the walls the strips left facing them.
+int num_strips = 1;
+
+void strip_columns(int strip, int &left, int &right)
+{
+	left = size_x*strip/num_strips;
+	right = size_x*(strip+1)/num_strips - 1;
+}
+
+// The strip whose thread digs from seed point #pos, or -1 if it opens onto
+// one of the strips' border columns, where no strip can dig from it.
+int seed_strip(Vector pos)
+{
+	int x = (pos + seed_heading(pos)).x, left, right;
+	
+	for(int ii=0; ii<num_strips; ii++) {
+		strip_columns(ii, left, right);
+		if(x > left && x < right)
+			return ii;
+	}
+	return -1;
+}
+
+// Make sure every entrance in the outer wall opens onto the map. One whose
+// first feature didn't fit is dug from again, and if nothing fits, as when
+// a room sits one row in from the edge, a tunnel is dug straight in until it
+// runs alongside floor or reaches a door, or a wall with floor behind it,
+// which gets a door. A room's corner right inside the entrance is dug out,
+// and the tunnel goes round from there.
+void open_entrances(void)
+{
+	for(size_t ii=0; ii<seed_points.size(); ii++)
+	{
+		Vector pos = seed_points[ii], heading = seed_heading(pos), v = pos+heading;
+		if(heading == Vector(0, 0) || grid[pos.y][pos.x] != TILE_DOOR)
+			continue;
+		
+		for(int tries=0; tries<max_tries && !is_known(v); tries++) {
+			doorways.push_back(Doorway(pos, heading, true));
+			dig_loop();
+		}
+		for(; is_in_bounds(v) && !is_floor(v) && !is_permawall(v); v = v+heading)
+		{
+			if(grid[v.y][v.x] == TILE_DOOR)
+				break;
+			if(grid[v.y][v.x] == TILE_WALL && is_floor(v+heading)) {
+				log_event(EVENT_DOOR, v, heading);
+				door_tile(v);
+				break;
+			}
+			
+			log_event(EVENT_DIG, v, heading);
+			dig_tile(v);
+			bool beside_floor = false;
+			for(int side=0; side<2; side++) {
+				Vector wall = v + (side ? heading.left() : heading.right());
+				beside_floor |= is_floor(wall) || grid[wall.y][wall.x] == TILE_DOOR;
+				if(!is_known(wall)) {
+					log_event(EVENT_FILL, wall, heading);
+					fill_tile(wall);
+				}
+			}
+			if(beside_floor)
+				break;
+		}
+		
+		v = pos+heading;
+		if(grid[v.y][v.x] == TILE_PERMAWALL && is_in_bounds(v)) {
+			log_event(EVENT_DIG, v, heading);
+			dig_tile(v);
+			std::vector<int> queue(1, v.y*size_x + v.x);
+			dig_tunnel(queue, false);
+		}
+	}
+}
+
+void dig_map(void)
+{
+	if(num_strips <= 1) {
+		seed_entrances();
+		dig_loop();
+	}
+	else
+	{
+		std::vector<std::thread> threads;
+		for(int ii=0; ii<num_strips; ii++)
+		{
+			int left, right;
+			strip_columns(ii, left, right);
+			unsigned seed = rand_r(&rng_state);
+			threads.push_back(std::thread([=](int **map) {
+				grid = map;
+				rng_state = seed;
+				bounds_left = left;
+				bounds_right = right;
+				double start = now_seconds();
+				seed_entrances();
+				dig_loop();
+				trace("strip", start);
+			}, grid));
+		}
+		for(size_t ii=0; ii<threads.size(); ii++)
+			threads[ii].join();
+		
+		double start = now_seconds();
+		rebuild_frontier();
+		dig_loop();
+		trace("gaps", start);
+	}
+	open_entrances();
+	
+	if(seed_points.size() > 1 || num_strips > 1) {
+		double start = now_seconds();
+		connect_components();
+		trace("connect", start);
+	}
+	
+	for(size_t ii=0; ii<seed_points.size(); ii++)
+	{
+		Vector pos = seed_points[ii], into = pos + seed_heading(pos);
+		if(!(into == pos) && !is_floor(into) && grid[into.y][into.x] != TILE_DOOR)
+			fprintf(stderr, "Entrance %i,%i isn't connected to the map.\n", pos.x, pos.y);
+	}
+}
+
+//
+// Map metrics for QA, written as JSON. The first pass counts each kind of
+// tile, dug (known) tiles per row and column, and the bounding box of the
+// dug area, over bands of rows on separate threads; its inner loops are
+// branch-free so they vectorize. The second pass reuses label_regions():
+// each region is a room or corridor, and regions joined through doors form
+// the connected components.
+//
+class MetricsBand
+{
+public:
+	long floor = 0, wall = 0, doors = 0;
+	std::vector<int> col_dug;
+	int min_x, min_y, max_x = -1, max_y = -1;
+};
+
+void count_band(int **g, int first_row, int last_row, int *row_dug, MetricsBand &band)
+{
+	band.col_dug.assign(size_x, 0);
+	band.min_x = size_x;
+	band.min_y = size_y;
+	
+	for(int yi=first_row; yi<last_row; yi++)
+	{
+		const int *row = g[yi];
+		int floor = 0, wall = 0, doors = 0, dug = 0;
+		
+		for(int xi=0; xi<size_x; xi++)
+		{
+			int flags = tile_flags[row[xi]];
+			floor += (flags & TF_FLOOR) != 0;
+			wall  += (flags & (TF_KNOWN|TF_BLOCKS)) == (TF_KNOWN|TF_BLOCKS);
+			doors += (flags & TF_DOOR) != 0;
+			dug   += (flags & TF_KNOWN) != 0;
+			band.col_dug[xi] += (flags & TF_KNOWN) != 0;
+		}
+		band.floor += floor;
+		band.wall += wall;
+		band.doors += doors;
+		row_dug[yi] = dug;
+		if(!dug)
+			continue;
+		
+		int first = 0, last = size_x-1;
+		while(!tile_has(row[first], TF_KNOWN)) first++;
+		while(!tile_has(row[last], TF_KNOWN)) last--;
+		band.min_x = std::min(band.min_x, first);
+		band.max_x = std::max(band.max_x, last);
+		band.min_y = std::min(band.min_y, yi);
+		band.max_y = yi;
+	}
+}
+
+void write_int_array(FILE *fout, const char *name, const std::vector<int> &values)
+{
+	fprintf(fout, "  \"%s\": [", name);
+	for(size_t ii=0; ii<values.size(); ii++)
+		fprintf(fout, ii ? ",%i" : "%i", values[ii]);
+	fprintf(fout, "]");
+}
+
+class MapMetrics
+{
+public:
+	long floor = 0, wall = 0, doors = 0;
+	int regions = 0, rooms = 0, components = 0;
+	long largest_component = 0;
+	int min_x, min_y, max_x = -1, max_y = -1;
+	std::vector<int> row_dug, col_dug;
+};
+
+void compute_metrics(MapMetrics &m, int max_threads)
+{
+	// Pass 1: tile counts, with at least 64 rows per thread
+	int num_bands = std::max(1, std::min(max_threads, size_y/64));
+	std::vector<MetricsBand> bands(num_bands);
+	std::vector<std::thread> threads;
+	
+	m = MapMetrics();
+	m.row_dug.assign(size_y, 0);
+	m.col_dug.assign(size_x, 0);
+	for(int ii=1; ii<num_bands; ii++)
+		threads.push_back(std::thread(count_band, grid, size_y*ii/num_bands,
+			size_y*(ii+1)/num_bands, &m.row_dug[0], std::ref(bands[ii])));
+	count_band(grid, 0, size_y/num_bands, &m.row_dug[0], bands[0]);
+	for(size_t ii=0; ii<threads.size(); ii++)
+		threads[ii].join();
+	
+	m.min_x = size_x;
+	m.min_y = size_y;
+	for(int ii=0; ii<num_bands; ii++)
+	{
+		m.floor += bands[ii].floor;
+		m.wall += bands[ii].wall;
+		m.doors += bands[ii].doors;
+		for(int xi=0; xi<size_x; xi++)
+			m.col_dug[xi] += bands[ii].col_dug[xi];
+		if(bands[ii].max_y < 0)
+			continue;
+		m.min_x = std::min(m.min_x, bands[ii].min_x);
+		m.min_y = std::min(m.min_y, bands[ii].min_y);
+		m.max_x = std::max(m.max_x, bands[ii].max_x);
+		m.max_y = std::max(m.max_y, bands[ii].max_y);
+	}
+	
+	// Pass 2: regions, and the components they form through doors. Corridors
+	// are one tile wide, so a region is a room if it has a 2x2 block of floor.
+	label_regions();
+	std::vector<int> parent, cells(num_regions+1, 0);
+	std::vector<char> is_room(num_regions+1, 0);
+	join_through_doors(parent);
+	for(int yi=0; yi<size_y; yi++)
+	for(int xi=0; xi<size_x; xi++)
+	{
+		int here = region[yi][xi];
+		cells[here]++;
+		if(here && xi+1<size_x && yi+1<size_y && region[yi][xi+1]==here
+		 && region[yi+1][xi]==here && region[yi+1][xi+1]==here)
+			is_room[here] = 1;
+	}
+	std::vector<long> component_cells(num_regions+1, 0);
+	for(int ii=1; ii<=num_regions; ii++)
+		component_cells[find_label(parent, ii)] += cells[ii];
+	for(int ii=1; ii<=num_regions; ii++)
+	{
+		if(find_label(parent, ii) != ii)
+			continue;
+		m.components++;
+		m.largest_component = std::max(m.largest_component, component_cells[ii]);
+	}
+	m.regions = num_regions;
+	m.rooms = std::count(is_room.begin(), is_room.end(), 1);
+}
+
+bool write_metrics(const char *filename, const MapMetrics &m)
+{
+	FILE *fout = fopen(filename, "w");
+	if(!fout)
+		return false;
+	
+	double area = (double)size_x * size_y;
+	fprintf(fout, "{\n");
+	fprintf(fout, "  \"width\": %i,\n  \"height\": %i,\n", size_x, size_y);
+	fprintf(fout, "  \"floor_fraction\": %.6f,\n", m.floor / area);
+	fprintf(fout, "  \"wall_fraction\": %.6f,\n", m.wall / area);
+	fprintf(fout, "  \"door_count\": %li,\n", m.doors);
+	fprintf(fout, "  \"region_count\": %i,\n", m.regions);
+	fprintf(fout, "  \"room_count\": %i,\n", m.rooms);
+	fprintf(fout, "  \"components\": %i,\n", m.components);
+	fprintf(fout, "  \"largest_component_share\": %.6f,\n", m.floor ? (double)m.largest_component / m.floor : 0.0);
+	if(m.max_y >= 0)
+		fprintf(fout, "  \"dug_bbox\": {\"x0\": %i, \"y0\": %i, \"x1\": %i, \"y1\": %i},\n",
+			m.min_x, m.min_y, m.max_x, m.max_y);
+	else
+		fprintf(fout, "  \"dug_bbox\": null,\n");
+	write_int_array(fout, "row_dug", m.row_dug);
+	fprintf(fout, ",\n");
+	write_int_array(fout, "column_dug", m.col_dug);
+	fprintf(fout, "\n}\n");
+	fclose(fout);
+	return true;
+}
+
+// Compute the finished map's metrics and write them to #filename.
+bool save_metrics(const char *filename)
+{
+	MapMetrics m;
+	compute_metrics(m, std::thread::hardware_concurrency());
+	return write_metrics(filename, m);
+}
+
+//
+// Tracing for -trace. Each thread records spans (digging, scoring, waiting
+// for a lock, writing output) into its own ring buffer, so recording takes
+// no locks; a thread only takes trace_lock once, to add its ring to the
+// list. If a thread records more than trace_ring_size spans, the oldest are
+// overwritten. At the end of the run every ring is written out in the
+// Chrome trace event format, for chrome://tracing or Perfetto.
+//
+const int trace_ring_size = 8192;
+
+class TraceSpan
+{
+public:
+	const char *name;
+	double start, end;   // Seconds, from now_seconds()
+	long arg;            // The candidate's seed, or -1
+};
+
+class TraceRing
+{
+public:
+	TraceSpan spans[trace_ring_size];
+	unsigned long count = 0;
+	int tid;
+};
+
+bool tracing;
+std::mutex trace_lock;
+std::vector<TraceRing*> trace_rings;
+thread_local TraceRing *my_trace_ring;
+
+double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void trace(const char *name, double start, long arg)
+{
+	if(!tracing)
+		return;
+	if(!my_trace_ring)
+	{
+		my_trace_ring = new TraceRing();
+		std::lock_guard<std::mutex> guard(trace_lock);
+		my_trace_ring->tid = trace_rings.size()+1;
+		trace_rings.push_back(my_trace_ring);
+	}
+	TraceSpan &span = my_trace_ring->spans[my_trace_ring->count++ % trace_ring_size];
+	span.name = name;
+	span.start = start;
+	span.end = now_seconds();
+	span.arg = arg;
+}
+
+// Lock #lock, recording the time spent waiting for it. The caller unlocks
+// it, usually by adopting it into a lock_guard.
+void lock_traced(std::mutex &lock)
+{
+	double start = tracing ? now_seconds() : 0;
+	lock.lock();
+	trace("wait", start);
+}
+
+bool write_trace(const char *filename)
+{
+	FILE *fout = fopen(filename, "w");
+	if(!fout)
+		return false;
+	
+	// Start the timeline at the earliest span still recorded
+	double origin = -1;
+	for(size_t ii=0; ii<trace_rings.size(); ii++)
+	{
+		TraceRing *ring = trace_rings[ii];
+		for(unsigned long jj = ring->count>(unsigned long)trace_ring_size ? ring->count-trace_ring_size : 0; jj<ring->count; jj++)
+			if(origin < 0 || ring->spans[jj % trace_ring_size].start < origin)
+				origin = ring->spans[jj % trace_ring_size].start;
+	}
+	
+	fprintf(fout, "{\"traceEvents\": [\n");
+	for(size_t ii=0; ii<trace_rings.size(); ii++)
+	{
+		TraceRing *ring = trace_rings[ii];
+		fprintf(fout, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %i, "
+			"\"args\": {\"name\": \"thread %i\"}}", ii ? ",\n" : "", ring->tid, ring->tid);
+		for(unsigned long jj = ring->count>(unsigned long)trace_ring_size ? ring->count-trace_ring_size : 0; jj<ring->count; jj++)
+		{
+			TraceSpan &span = ring->spans[jj % trace_ring_size];
+			fprintf(fout, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %i, "
+				"\"ts\": %.3f, \"dur\": %.3f", span.name, ring->tid,
+				(span.start-origin)*1e6, (span.end-span.start)*1e6);
+			if(span.arg >= 0)
+				fprintf(fout, ", \"args\": {\"seed\": %li}", span.arg);
+			fprintf(fout, "}");
+		}
+	}
+	fprintf(fout, "\n]}\n");
+	fclose(fout);
+	return true;
+}
+
+
+//
+// Best-of-N generation. -candidates N digs N maps from the seeds seed,
+// seed+1, ... on -j worker threads and keeps the one with the highest
+// score. A candidate is also scored at checkpoints while it's being dug,
+// and given up on if it trails the best finished map at the same checkpoint
+// by more than cancel_margin. The winning seed is reported, and passing it
+// to -seed reproduces the map.
+//
+typedef double (*score_func)(const MapMetrics &m);
+
+double score_floor(const MapMetrics &m) { return (double)m.floor / ((double)size_x*size_y); }
+double score_rooms(const MapMetrics &m) { return m.rooms; }
+double score_loops(const MapMetrics &m) { return m.doors - (m.regions - m.components); }
+
+struct ScoreEntry {
+	const char *name;
+	score_func func;
+} score_funcs[] = {
+	{ "floor", score_floor },  // Fraction of the map that's floor
+	{ "rooms", score_rooms },  // Number of rooms, not counting corridors
+	{ "loops", score_loops },  // Doors beyond the ones needed to connect everything
+};
+
+const double cancel_margin = 0.1;
+const int max_checkpoints = 32;
+
+class CandidateSearch
+{
+public:
+	std::mutex lock;
+	score_func score;
+	unsigned first_seed;
+	int num_candidates, next_candidate = 0, cancelled = 0;
+	int loop_distance;
+	
+	int **best_grid = NULL;
+	unsigned best_seed = 0;
+	double best_score = 0;
+	std::vector<double> best_checkpoints;
+};
+CandidateSearch candidate_search;
+thread_local std::vector<double> checkpoints;
+thread_local bool candidate_cancelled;
+thread_local unsigned rng_seed;   // The seed of the candidate being dug
+
+bool candidate_checkpoint(int index)
+{
+	if(index >= max_checkpoints)
+		return true;
+	
+	MapMetrics m;
+	double start = now_seconds();
+	compute_metrics(m, 1);
+	checkpoints.push_back(candidate_search.score(m));
+	trace("score", start, rng_seed);
+	
+	lock_traced(candidate_search.lock);
+	std::lock_guard<std::mutex> guard(candidate_search.lock, std::adopt_lock);
+	if(candidate_search.best_grid && index < (int)candidate_search.best_checkpoints.size()
+	 && checkpoints[index] < candidate_search.best_checkpoints[index] - cancel_margin*fabs(candidate_search.best_checkpoints[index]))
+		candidate_cancelled = true;
+	return !candidate_cancelled;
+}
+
+void candidate_worker(void)
+{
+	dig_checkpoint = candidate_checkpoint;
+	first_checkpoint = std::max(16, size_x*size_y/256);
+	
+	for(;;)
+	{
+		int index;
+		{
+			lock_traced(candidate_search.lock);
+			std::lock_guard<std::mutex> guard(candidate_search.lock, std::adopt_lock);
+			if(candidate_search.next_candidate >= candidate_search.num_candidates)
+				break;
+			index = candidate_search.next_candidate++;
+		}
+		
+		rng_seed = candidate_search.first_seed + index;
+		rng_state = rng_seed;
+		checkpoints.clear();
+		candidate_cancelled = false;
+		double start = now_seconds();
+		init_map();
+		dig_map();
+		if(!candidate_cancelled && candidate_search.loop_distance > 0)
+			add_loops(candidate_search.loop_distance);
+		trace("generate", start, rng_seed);
+		
+		MapMetrics m;
+		double score = 0;
+		if(!candidate_cancelled)
+		{
+			start = now_seconds();
+			compute_metrics(m, 1);
+			score = candidate_search.score(m);
+			trace("score", start, rng_seed);
+		}
+		
+		{
+			lock_traced(candidate_search.lock);
+			std::lock_guard<std::mutex> guard(candidate_search.lock, std::adopt_lock);
+			if(candidate_cancelled)
+				candidate_search.cancelled++;
+			else if(!candidate_search.best_grid || score > candidate_search.best_score
+			     || (score == candidate_search.best_score && rng_seed < candidate_search.best_seed))
+			{
+				std::swap(grid, candidate_search.best_grid);
+				candidate_search.best_score = score;
+				candidate_search.best_seed = rng_seed;
+				candidate_search.best_checkpoints = checkpoints;
+			}
+		}
+		
+		start = now_seconds();
+		if(grid)
+			free_map(grid);
+		grid = NULL;
+		trace("free", start, rng_seed);
+	}
+}
+
+void best_of_candidates(int candidates, unsigned seed, int jobs, score_func score, int loop_distance)
+{
+	std::vector<std::thread> threads;
+	
+	candidate_search.score = score;
+	candidate_search.first_seed = seed;
+	candidate_search.num_candidates = candidates;
+	candidate_search.loop_distance = loop_distance;
+	for(int ii=1; ii<jobs; ii++)
+		threads.push_back(std::thread(candidate_worker));
+	candidate_worker();
+	for(size_t ii=0; ii<threads.size(); ii++)
+		threads[ii].join();
+	
+	// The main thread's worker leaves its checkpoint hook behind
+	dig_checkpoint = NULL;
+	grid = candidate_search.best_grid;
+	fprintf(stderr, "Best of %i candidates: seed %u, score %f (%i cancelled early)\n",
+		candidates, candidate_search.best_seed, candidate_search.best_score, candidate_search.cancelled);
+}
+
+//
+// Benchmarking. -bench digs a number of maps and reports, for each kind of
+// feature, how often it's tried and fits, and the time and hardware counters
+// per call (see perf_counters.h). A feature call is short next to the two
+// system calls it takes to read the counters around it, so they're only
+// read around one call in counter_sample, and what a read pair counts
+// around nothing is measured first and taken off. Times are taken around
+// every call, from the vDSO clock, which is cheap.
+//
+const int counter_sample = 16;
+double counter_overhead[NUM_COUNTERS], clock_overhead;
+
+class FeatureStats
+{
+public:
+	long calls = 0, fits = 0, sampled = 0;
+	double seconds = 0;
+	double counters[NUM_COUNTERS] = {0};
+};
+
+void measure_feature(int which, Vector pos, Vector heading, int &success)
+{
+	FeatureStats &stats = (*feature_stats)[which];
+	uint64_t before[NUM_COUNTERS], after[NUM_COUNTERS];
+	bool sample = counters_open && stats.calls % counter_sample == 0;
+	
+	if(sample)
+		read_counters(before);
+	double start = now_seconds();
+	success = features[which](pos, heading);
+	stats.seconds += now_seconds() - start;
+	if(sample) {
+		read_counters(after);
+		stats.sampled++;
+		for(int ii=0; ii<NUM_COUNTERS; ii++)
+			stats.counters[ii] += after[ii] - before[ii];
+	}
+	
+	stats.calls++;
+	stats.fits += success != 0;
+}
+
+// Average what the counters and the clock see around a feature call with no
+// call in it
+void measure_overhead(void)
+{
+	const int reps = 10000;
+	uint64_t before[NUM_COUNTERS], after[NUM_COUNTERS];
+	double totals[NUM_COUNTERS] = {0}, seconds = 0;
+	
+	for(int rep=0; rep<reps; rep++)
+	{
+		read_counters(before);
+		double start = now_seconds();
+		seconds += now_seconds() - start;
+		read_counters(after);
+		for(int ii=0; ii<NUM_COUNTERS; ii++)
+			totals[ii] += after[ii] - before[ii];
+	}
+	for(int ii=0; ii<NUM_COUNTERS; ii++)
+		counter_overhead[ii] = totals[ii] / reps;
+	clock_overhead = seconds / reps;
+}
+
+void benchmark(int runs, unsigned seed)
+{
+	std::vector<FeatureStats> stats(features.size());
+	double total = 0;
+	
+	open_counters();
+	measure_overhead();
+	feature_stats = &stats;
+	for(int run=0; run<runs; run++)
+	{
+		rng_state = seed + run;
+		init_map();
+		double start = now_seconds();
+		seed_entrances();
+		dig_loop();
+		total += now_seconds() - start;
+		free_map(grid);
+		grid = NULL;
+	}
+	feature_stats = NULL;
+	
+	printf("%d maps, %.2f ms each\n\n", runs, total*1000/runs);
+	printf("%-10s %10s %6s %10s", "feature", "calls", "fit%", "ns/call");
+	for(int ii=0; ii<NUM_COUNTERS; ii++)
+		if(counter_slot[ii] >= 0)
+			printf(" %10s", counter_names[ii]);
+	putchar('\n');
+	for(size_t ii=0; ii<features.size(); ii++)
+	{
+		FeatureStats &f = stats[ii];
+		long calls = std::max(f.calls, 1L), sampled = std::max(f.sampled, 1L);
+		printf("%-10s %10li %6.1f %10.1f", feature_names[ii], f.calls,
+			f.fits*100.0/calls, (f.seconds/calls - clock_overhead)*1e9);
+		for(int jj=0; jj<NUM_COUNTERS; jj++)
+			if(counter_slot[jj] >= 0)
+				printf(" %10.1f", f.counters[jj]/sampled - counter_overhead[jj]);
+		putchar('\n');
+	}
+	if(!counters_open)
+		printf("\nHardware counters unavailable; times only.\n");
+	else {
+		printf("\nCounters are from 1 call in %i, less what reading them around nothing\n"
+		       "counts (%.0f cycles, %.0f instrs); expect a few misses of noise per call.\n",
+		       counter_sample, counter_overhead[0], counter_overhead[1]);
+	}
+}
+
+// -pagebench: dig #runs maps with each combination of small or huge pages
+// and one thread or a band per CPU clearing the map, with the same seeds
+// for all, and report the time to clear the map, as bandwidth since it's
+// nothing but writes, and the time and dTLB and LLC misses per cell for
+// digging it.
+void page_benchmark(int runs, unsigned seed)
+{
+	static const char *mode_names[4] = { "4k/serial", "2M/serial", "4k/bands", "2M/bands" };
+	const int shown[2] = { 5, 3 };   // dTLB-miss, LLC-miss
+	double cells = (double)size_x * size_y * runs;
+	char thp[64] = "unknown";
+	
+	if(FILE *fin = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r")) {
+		if(fgets(thp, sizeof(thp), fin))
+			thp[strcspn(thp, "\n")] = 0;
+		fclose(fin);
+	}
+	open_counters();
+	printf("Transparent huge pages: %s\n\n", thp);
+	printf("%-12s %10s %8s %10s %10s %10s\n",
+		"pages/touch", "touch(ms)", "GB/s", "dig(ms)", "dTLB-miss", "LLC-miss");
+	for(int mode=0; mode<4; mode++)
+	{
+		double touch_time = 0, dig_time = 0;
+		double totals[NUM_COUNTERS] = {0};
+		uint64_t before[NUM_COUNTERS], after[NUM_COUNTERS];
+		
+		huge_pages = mode & 1;
+		for(int run=0; run<runs; run++)
+		{
+			rng_state = seed + run;
+			double start = now_seconds();
+			init_map(mode & 2 ? std::thread::hardware_concurrency() : 1);
+			touch_time += now_seconds() - start;
+			
+			read_counters(before);
+			start = now_seconds();
+			seed_entrances();
+			dig_loop();
+			dig_time += now_seconds() - start;
+			read_counters(after);
+			for(int ii=0; ii<NUM_COUNTERS; ii++)
+				totals[ii] += after[ii] - before[ii];
+			
+			free_map(grid);
+			grid = NULL;
+		}
+		
+		printf("%-12s %10.2f %8.2f %10.2f", mode_names[mode], touch_time*1000/runs,
+			sizeof(int)*cells / touch_time / 1e9, dig_time*1000/runs);
+		for(int counter : shown) {
+			if(counter_slot[counter] >= 0)
+				printf(" %10.4f", totals[counter] / cells);
+			else
+				printf(" %10s", "n/a");
+		}
+		putchar('\n');
+	}
+	huge_pages = true;
+}
+
+//
+// Replaying an event log written with -record.
+//
+int read_varint(FILE *fin, unsigned &value)
+{
+	int shift = 0, c;
+	
+	value = 0;
+	while(shift < 35 && (c = getc(fin)) != EOF)
+	{
+		value |= (unsigned)(c & 0x7f) << shift;
+		if(!(c & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+// Read the header of an event log and take the map size from it.
+bool read_log_header(FILE *fin)
+{
+	char magic[4];
+	unsigned x, y;
+	
+	if(fread(magic, 1, 4, fin) != 4 || memcmp(magic, "DLOG", 4))
+		return false;
+	if(!read_varint(fin, x) || !read_varint(fin, y) || x < 3 || y < 3)
+		return false;
+	size_x = x;
+	size_y = y;
+	return true;
+}
+
+// Check that a rectangle laid out like area_is_clear()'s is inside the map.
+bool area_in_bounds(Vector corner, Vector heading, Vector size)
+{
+	Vector far = corner + heading.right()*(size.x-1) + heading*(size.y-1);
+	return size.x > 0 && size.y > 0
+	    && is_in_bounds_or_border(corner) && is_in_bounds_or_border(far);
+}
+
+// Rebuild the map from the records in #fin, with no random numbers and no
+// checks beyond keeping everything inside the map. With #dump, print the
+// records as text instead, one per line. Return false if the log is
+// malformed.
+bool replay_log(FILE *fin, FILE *dump)
+{
+	int position = 0;
+	
+	for(;;)
+	{
+		int c = getc(fin);
+		unsigned delta, args[3];
+		int num_args;
+		
+		if(c == EOF)
+			return false;
+		int type = c & 15;
+		Vector heading = headings[(c>>4) & 3];
+		if(type == EVENT_END)
+			return true;
+		if(type > EVENT_FILL || !read_varint(fin, delta))
+			return false;
+		position += (int)(delta>>1) ^ -(int)(delta&1);
+		if(position < 0 || position >= size_x*size_y)
+			return false;
+		Vector pos = Vector(position % size_x, position / size_x);
+		
+		switch(type) {
+			case EVENT_ROOM:
+			case EVENT_CAVE:     num_args = 3; break;
+			case EVENT_PREFAB:   num_args = 2; break;
+			case EVENT_CORRIDOR: num_args = 1; break;
+			default:             num_args = 0; break;
+		}
+		for(int ii=0; ii<num_args; ii++)
+			if(!read_varint(fin, args[ii]))
+				return false;
+		
+		if(dump) {
+			fprintf(dump, "%s %i %i %c", event_names[type], pos.x, pos.y, "NESW"[heading_index(heading)]);
+			for(int ii=0; ii<num_args; ii++)
+				fprintf(dump, " %u", args[ii]);
+		}
+		
+		switch(type)
+		{
+			case EVENT_ROOM: {
+				Vector size = Vector(args[0], args[1]);
+				if(args[2] > args[0] || !area_in_bounds(pos + heading.left()*args[2], heading, size+Vector(2, 2)))
+					return false;
+				if(!dump)
+					stamp_room(pos, heading, size, args[2]);
+				break;
+			}
+			case EVENT_CORRIDOR: {
+				Vector end;
+				if(!area_in_bounds(pos + heading.left(), heading, Vector(3, args[0]+1)))
+					return false;
+				if(!dump)
+					stamp_corridor(pos, heading, args[0], end);
+				break;
+			}
+			case EVENT_CAVE: {
+				Vector size = Vector(args[0], args[1]);
+				int dug = 0;
+				if(args[0] > (unsigned)cave_max_size || args[1] > (unsigned)cave_max_size || args[2] > args[0]
+				 || !area_in_bounds(pos + heading.left()*args[2], heading, size+Vector(2, 2)))
+					return false;
+				for(int yi=0; yi<size.y+2; yi++)
+				for(int xi=0; xi<size.x+2; xi++)
+					cave_buf[yi][xi] = 1;
+				for(int yi=1; yi<=size.y; yi++)
+				{
+					unsigned bits;
+					if(!read_varint(fin, bits))
+						return false;
+					for(int xi=1; xi<=size.x; xi++)
+						if(bits & (1u << (xi-1))) {
+							cave_buf[yi][xi] = 2;
+							dug++;
+						}
+				}
+				if(dump)
+					fprintf(dump, " %i", dug);
+				else
+					stamp_cave(pos, heading, size, args[2]);
+				break;
+			}
+			case EVENT_PREFAB: {
+				if(args[0] >= prefabs.size() || args[1] >= prefabs[args[0]].anchors.size())
+					return false;
+				const Prefab &prefab = prefabs[args[0]];
+				Vector origin = pos - prefab.anchors[args[1]];
+				if(!is_in_bounds_or_border(origin)
+				 || !is_in_bounds_or_border(origin + Vector(prefab.width-1, prefab.height-1)))
+					return false;
+				if(!dump)
+					stamp_prefab(args[0], args[1], pos);
+				break;
+			}
+			case EVENT_DOOR: if(!dump) door_tile(pos); break;
+			case EVENT_DIG:  if(!dump) dig_tile(pos);  break;
+			case EVENT_FILL: if(!dump) fill_tile(pos); break;
+		}
+		if(dump)
+			putc('\n', dump);
+	}
+}
+
+
+int is_in_bounds(Vector v)
+{
+	return v.x>=1 && v.y>=1 && v.x<size_x-1 && v.y<size_y-1
+	    && v.x>bounds_left && v.x<bounds_right && v.y>bounds_top && v.y<bounds_bottom
+	    && (v.x>=frozen_x || v.y>=frozen_y);
+}
+int is_in_bounds_or_border(Vector v)
+{
+	return v.x>=0 && v.y>=0 && v.x<size_x && v.y<size_y
+	    && v.x>=bounds_left && v.x<=bounds_right && v.y>=bounds_top && v.y<=bounds_bottom
+	    && (v.x>=frozen_x-1 || v.y>=frozen_y-1);
+}
+
+int is_known(Vector v) {
+	return tile_flags[grid[v.y][v.x]] & TF_KNOWN;
+}
+int is_floor(Vector v) {
+	return tile_flags[grid[v.y][v.x]] & TF_FLOOR;
+}
+int is_wall(Vector v) {
+	return tile_flags[grid[v.y][v.x]] & TF_BLOCKS;
+}
+int is_permawall(Vector v) {
+	return tile_flags[grid[v.y][v.x]] & TF_PERMANENT;
+}
+void dig_tile(Vector v) {
+	grid[v.y][v.x] = TILE_FLOOR;
+}
+void door_tile(Vector v) {
+	grid[v.y][v.x] = TILE_DOOR;
+}
+void fill_tile(Vector v) {
+	grid[v.y][v.x] = TILE_WALL;
+}
+void permawall_tile(Vector v) {
+	grid[v.y][v.x] = TILE_PERMAWALL;
+}
+
+
+// Return a random number between Min and Max.
+int rand_range(int Min, int Max)
+{
+	return rand_r(&rng_state) % (Max-Min+1) + Min;
+}
+
+
+int **alloc_grid(int width, int height)
+{
+	int **rows = (int**)malloc(sizeof(int*) * height);
+	size_t bytes = sizeof(int) * (size_t)width * height;
+	void *block = NULL;
+	
+	if(bytes >= huge_page) {
+		bytes = (bytes + huge_page-1) / huge_page * huge_page;
+		if(!posix_memalign(&block, huge_page, bytes))
+			madvise(block, bytes, huge_pages ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	} else
+		block = malloc(bytes);
+	
+	for(int yi=0; yi<height; yi++)
+		rows[yi] = (int*)block + (size_t)yi * width;
+	return rows;
+}
+
+// Run #func(first row, last row) over #rows rows, split into bands of at
+// least 64 rows for up to #max_threads threads, the way compute_metrics()
+// and print_map() split the map.
+void for_row_bands(int rows, int max_threads, std::function<void(int, int)> func)
+{
+	int num_bands = std::max(1, std::min(max_threads, rows/64));
+	std::vector<std::thread> threads;
+	
+	for(int ii=1; ii<num_bands; ii++)
+		threads.push_back(std::thread(func, (long)rows*ii/num_bands, (long)rows*(ii+1)/num_bands));
+	func(0, rows/num_bands);
+	for(size_t ii=0; ii<threads.size(); ii++)
+		threads[ii].join();
+}
+
+// Make a new map of undug rock, cleared by up to #max_threads threads, a
+// band of rows each. A page is placed on the NUMA node of the thread that
+// first writes it, and digging runs on one thread, or on column strips that
+// don't line up with bands of rows, so by default the map is cleared on the
+// calling thread; the banded clear is only there for -pagebench to compare.
+void init_map(int max_threads)
+{
+	int **g = grid = alloc_grid(size_x, size_y);
+	
+	for_row_bands(size_y, max_threads, [=](int first, int last) {
+		for(int yi=first; yi<last; yi++)
+			std::fill(g[yi], g[yi]+size_x, (int)TILE_UNKNOWN);
+	});
+}
+
+void free_map(int **g)
+{
+	free(g[0]);
+	free(g);
+}
+
+// Grow the map by #dx columns on the right and #dy rows at the bottom,
+// keeping everything in it, and freeze the old area so digging carries on
+// only in the new part. The rows can't grow where they are inside one
+// block, so the old map is copied into a new one, on this thread like
+// init_map(); that's a plain streaming copy, and all the digging is in the
+// new cells. Doorways hold positions computed from size_x, so the frontier
+// must be empty.
+void extend_map(int dx, int dy)
+{
+	assert(doorways.empty() && !region);
+	int old_x = size_x, old_y = size_y;
+	int **old = grid;
+	int **g = grid = alloc_grid(old_x+dx, old_y+dy);
+	
+	for(int yi=0; yi<old_y+dy; yi++)
+	{
+		int copied = yi < old_y ? old_x : 0;
+		if(copied)
+			memcpy(g[yi], old[yi], sizeof(int) * old_x);
+		std::fill(g[yi]+copied, g[yi]+old_x+dx, (int)TILE_UNKNOWN);
+	}
+	free_map(old);
+	size_x = old_x+dx;
+	size_y = old_y+dy;
+	frozen_x = old_x;
+	frozen_y = old_y;
+}
+
+// Clear columns x0..x1-1 and rows y0..y1-1 to undug rock and dig them again,
+// with digging confined to that rectangle, for -region. Digging starts from
+// whatever opens onto it: walls and doors around it with floor behind them,
+// and floor right up against its edge, which gets a door. Afterwards any
+// floor outside that's left facing undug rock is walled off, as is any door
+// around it that's left facing anything but floor or a door, and then
+// connect_components() joins up whatever that cut off, opening walls only
+// in the rectangle and its ring. Digging only looks at the rectangle and
+// the ring, so it costs in proportion to the region; the rejoining labels
+// the whole map.
+void regenerate_region(int x0, int y0, int x1, int y1)
+{
+	auto inside = [&](Vector v) { return v.x>=x0 && v.x<x1 && v.y>=y0 && v.y<y1; };
+	
+	// Call #visit(edge cell, the cell outside it, heading inward) for every
+	// pair of neighbours across the rectangle's edge
+	auto each_edge = [&](std::function<void(Vector, Vector, Vector)> visit) {
+		for(int yi=y0; yi<y1; yi++)
+		for(int xi=x0; xi<x1; xi++)
+		{
+			if(xi!=x0 && xi!=x1-1 && yi!=y0 && yi!=y1-1)
+				xi = x1-1;
+			for(int ii=0; ii<4; ii++)
+				if(!inside(Vector(xi, yi) - headings[ii]))
+					visit(Vector(xi, yi), Vector(xi, yi) - headings[ii], headings[ii]);
+		}
+	};
+	
+	for(int yi=y0; yi<y1; yi++)
+		std::fill(grid[yi]+x0, grid[yi]+x1, (int)TILE_UNKNOWN);
+	
+	bounds_left = x0-1;
+	bounds_right = x1;
+	bounds_top = y0-1;
+	bounds_bottom = y1;
+	
+	// Whether a door in the ring leads across the edge, from floor outside
+	// or from outside the map, rather than along it
+	auto leads_in = [](Vector outside, Vector heading) {
+		return grid[outside.y][outside.x] == TILE_DOOR
+		    && (seed_heading(outside) == heading || is_floor(outside-heading));
+	};
+	
+	rebuild_frontier(x0-1, y0-1, x1+1, y1+1);
+	each_edge([](Vector pos, Vector outside, Vector heading) {
+		if(is_floor(outside))
+			doorways.push_back(Doorway(pos, heading, true));
+	});
+	dig_loop();
+	
+	// An opening whose first feature didn't fit is dug from again, as
+	// open_entrances() does for entrances
+	for(int tries=1; tries<max_tries; tries++)
+	{
+		each_edge([&](Vector pos, Vector outside, Vector heading) {
+			if(is_known(pos))
+				return;
+			if(is_floor(outside))
+				doorways.push_back(Doorway(pos, heading, true));
+			else if(leads_in(outside, heading))
+				doorways.push_back(Doorway(outside, heading, true));
+		});
+		if(doorways.empty())
+			break;
+		dig_loop();
+	}
+	
+	each_edge([](Vector pos, Vector outside, Vector) {
+		if(!is_known(pos) && is_floor(outside))
+			fill_tile(pos);
+	});
+	
+	// A door in the ring has to open onto floor, a door or the outside of
+	// the map on both sides; wall off any that doesn't, and go round again,
+	// since that can strand a door beside it
+	auto open_to = [](Vector v) {
+		return v.x<0 || v.y<0 || v.x>=size_x || v.y>=size_y
+		    || is_floor(v) || grid[v.y][v.x] == TILE_DOOR;
+	};
+	for(bool walled=true; walled; )
+	{
+		walled = false;
+		each_edge([&](Vector, Vector outside, Vector heading) {
+			Vector side = heading.left();
+			if(grid[outside.y][outside.x] == TILE_DOOR
+			 && !(open_to(outside+heading) && open_to(outside-heading))
+			 && !(open_to(outside+side) && open_to(outside-side))) {
+				fill_tile(outside);
+				walled = true;
+			}
+		});
+	}
+	
+	// Walling doors off, and digging that didn't reach every opening, can
+	// cut the map in two, so join it up again through the region
+	connect_components();
+	
+	bounds_left = bounds_top = 0;
+	bounds_right = bounds_bottom = INT_MAX;
+}
+
+
+// Load an ASCII map, as printed by print_map() or edited by hand, in place
+// of an empty one, and take the map size from it. The file is mapped, lines
+// are found with memchr, and cells are translated through a character table
+// built from tile_chars, so '#' loads as plain wall; anything unrecognized,
+// and the padding of lines shorter than the longest, is undug rock.
+bool load_map(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return false;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return false;
+	}
+	void *mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapped == MAP_FAILED)
+		return false;
+	madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+	const char *data = (const char*)mapped, *end = data + st.st_size;
+	
+	std::vector<std::pair<const char*, size_t> > lines;
+	size_t width = 0;
+	for(const char *pos=data; pos<end; )
+	{
+		const char *eol = (const char*)memchr(pos, '\n', end-pos);
+		if(!eol)
+			eol = end;
+		size_t len = eol-pos;
+		if(len>0 && pos[len-1]=='\r')
+			len--;
+		width = std::max(width, len);
+		lines.push_back(std::make_pair(pos, len));
+		pos = eol+1;
+	}
+	
+	if(width < 3 || lines.size() < 3 || width > INT_MAX || lines.size() > INT_MAX) {
+		munmap(mapped, st.st_size);
+		return false;
+	}
+	size_x = width;
+	size_y = lines.size();
+	
+	// Later tiles first, so a character shared by two tiles loads as the
+	// first of them
+	uint8_t tile_of[256];
+	memset(tile_of, TILE_UNKNOWN, sizeof tile_of);
+	for(int ii=NUM_TILES-1; ii>=0; ii--)
+		tile_of[(unsigned char)tile_chars[ii]] = ii;
+	
+	init_map();
+	for(int yi=0; yi<size_y; yi++)
+	{
+		const char *row = lines[yi].first;
+		for(size_t xi=0; xi<lines[yi].second; xi++)
+			grid[yi][xi] = tile_of[(unsigned char)row[xi]];
+	}
+	munmap(mapped, st.st_size);
+	return true;
+}
+
+// print_map() turns rows into text through tile_chars into a buffer, and
+// writes the buffer with a few large write()s rather than a putchar() per
+// cell. Big maps go out in chunks of about print_chunk bytes, and each
+// chunk is split into bands formatted by separate threads.
+const size_t print_chunk = 16<<20;
+
+void format_rows(int **g, int first_row, int last_row, char *out)
+{
+	for(int yi=first_row; yi<last_row; yi++)
+	{
+		const int *row = g[yi];
+		for(int xi=0; xi<size_x; xi++)
+			out[xi] = tile_chars[row[xi]];
+		out[size_x] = '\n';
+		out += size_x+1;
+	}
+}
+
+bool write_all(int fd, const char *buf, size_t len)
+{
+	while(len > 0) {
+		ssize_t written = write(fd, buf, len);
+		if(written < 0)
+			return false;
+		buf += written;
+		len -= written;
+	}
+	return true;
+}
+
+void print_map(void)
+{
+	int chunk_rows = std::min<long>(size_y, std::max<long>(1, print_chunk / (size_x+1)));
+	std::vector<char> buf((size_t)chunk_rows * (size_x+1));
+	std::vector<std::thread> threads;
+	int **g = grid;
+	
+	fflush(stdout);
+	for(int first=0, last; first<size_y; first=last)
+	{
+		last = std::min(first+chunk_rows, size_y);
+		
+		// Not worth a thread for less than 64 rows each
+		int num_bands = std::max(1, std::min<int>(std::thread::hardware_concurrency(), (last-first)/64));
+		threads.clear();
+		for(int ii=1; ii<num_bands; ii++)
+		{
+			int band_first = first + (long)(last-first) * ii / num_bands;
+			int band_last = first + (long)(last-first) * (ii+1) / num_bands;
+			threads.push_back(std::thread(format_rows, g, band_first, band_last,
+				&buf[(size_t)(band_first-first) * (size_x+1)]));
+		}
+		format_rows(g, first, first + (last-first) / num_bands, &buf[0]);
+		for(size_t ii=0; ii<threads.size(); ii++)
+			threads[ii].join();
+		
+		if(!write_all(STDOUT_FILENO, &buf[0], (size_t)(last-first) * (size_x+1)))
+			break;
+	}
+}
+
+// Binary map files, for tools that would rather not parse text. A 16-byte
+// header ("MAPF", then the width, height and encoding as little-endian
+// 32-bit words) is followed by the cells as the characters print_map()
+// uses, row by row with no newlines. map_packed stores one byte per cell;
+// map_rle stores each row as runs, a cell byte followed by the run length
+// as a LEB128 varint, and no run goes past the end of a row.
+enum { map_packed, map_rle };
+
+bool write_map_file(const char *filename, int encoding)
+{
+	FILE *fout = fopen(filename, "wb");
+	if(!fout)
+		return false;
+	
+	unsigned char header[16] = "MAPF";
+	const uint32_t fields[3] = { (uint32_t)size_x, (uint32_t)size_y, (uint32_t)encoding };
+	for(int ii=0; ii<3; ii++)
+	for(int jj=0; jj<4; jj++)
+		header[4+ii*4+jj] = fields[ii] >> (jj*8);
+	fwrite(header, sizeof header, 1, fout);
+	
+	// A run costs at most two bytes per cell, since its varint can't be
+	// longer than the run
+	std::vector<unsigned char> row(2*size_x);
+	for(int yi=0; yi<size_y; yi++)
+	{
+		size_t len = 0;
+		for(int xi=0; xi<size_x; )
+		{
+			if(encoding == map_packed) {
+				row[len++] = tile_chars[grid[yi][xi++]];
+				continue;
+			}
+			int start = xi;
+			while(xi<size_x && grid[yi][xi]==grid[yi][start])
+				xi++;
+			row[len++] = tile_chars[grid[yi][start]];
+			unsigned run = xi-start;
+			for(; run>=0x80; run>>=7)
+				row[len++] = (run & 0x7f) | 0x80;
+			row[len++] = run;
+		}
+		fwrite(row.data(), len, 1, fout);
+	}
+	return fclose(fout) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	int argi = 1;
+	int loop_distance = 0;
+	const char *record_filename = NULL, *replay_filename = NULL;
+	const char *metrics_filename = NULL, *trace_filename = NULL;
+	const char *map_filename = NULL, *load_filename = NULL;
+	int map_encoding = map_packed;
+	Vector extend(0, 0);
+	int region[4], have_region = 0;
+	bool dump_log = false;
+	unsigned seed = time(NULL);
+	int candidates = 0, jobs = std::thread::hardware_concurrency();
+	int bench_runs = 0, page_bench_runs = 0;
+	score_func score = score_floor;
+	
+	features.push_back(dig_room);
+	feature_names.push_back("room");
+	features.push_back(dig_corridor);
+	feature_names.push_back("corridor");
+	
+	for(; argi<argc && argv[argi][0]=='-'; argi++)
+	{
+		if(!strcmp(argv[argi], "-loops") && argi+1<argc)
+			loop_distance = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-caves")) {
+			features.push_back(dig_cave);
+			feature_names.push_back("cave");
+		}
+		else if(!strcmp(argv[argi], "-prefabs") && argi+1<argc) {
+			if(load_prefabs(argv[++argi]) < 0) {
+				fprintf(stderr, "Could not read prefab file %s.\n", argv[argi]);
+				return 1;
+			}
+			features.push_back(dig_prefab);
+			feature_names.push_back("prefab");
+		}
+		else if(!strcmp(argv[argi], "-record") && argi+1<argc)
+			record_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-replay") && argi+1<argc)
+			replay_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-metrics") && argi+1<argc)
+			metrics_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-entrance") && argi+1<argc) {
+			Vector pos;
+			if(sscanf(argv[++argi], "%d,%d", &pos.x, &pos.y) != 2) {
+				fprintf(stderr, "Entrances are given as x,y.\n");
+				return 1;
+			}
+			seed_points.push_back(pos);
+		}
+		else if(!strcmp(argv[argi], "-trace") && argi+1<argc)
+			trace_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-load") && argi+1<argc)
+			load_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-region") && argi+1<argc) {
+			if(sscanf(argv[++argi], "%d,%d,%d,%d", &region[0], &region[1], &region[2], &region[3]) != 4) {
+				fprintf(stderr, "Regions are given as x0,y0,x1,y1.\n");
+				return 1;
+			}
+			have_region = 1;
+		}
+		else if(!strcmp(argv[argi], "-extend") && argi+1<argc) {
+			if(sscanf(argv[++argi], "%d,%d", &extend.x, &extend.y) != 2 || extend.x<0 || extend.y<0) {
+				fprintf(stderr, "Extensions are given as columns,rows.\n");
+				return 1;
+			}
+		}
+		else if(!strcmp(argv[argi], "-binary") && argi+1<argc) {
+			map_filename = argv[++argi];
+			map_encoding = map_packed;
+		}
+		else if(!strcmp(argv[argi], "-rle") && argi+1<argc) {
+			map_filename = argv[++argi];
+			map_encoding = map_rle;
+		}
+		else if(!strcmp(argv[argi], "-bench") && argi+1<argc)
+			bench_runs = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-pagebench") && argi+1<argc)
+			page_bench_runs = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-strips") && argi+1<argc)
+			num_strips = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-seed") && argi+1<argc)
+			seed = strtoul(argv[++argi], NULL, 0);
+		else if(!strcmp(argv[argi], "-candidates") && argi+1<argc)
+			candidates = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-j") && argi+1<argc)
+			jobs = atoi(argv[++argi]);
+		else if(!strcmp(argv[argi], "-score") && argi+1<argc) {
+			const ScoreEntry *entry = std::find_if(std::begin(score_funcs), std::end(score_funcs),
+				[&](const ScoreEntry &e) { return !strcmp(e.name, argv[argi+1]); });
+			if(entry == std::end(score_funcs)) {
+				fprintf(stderr, "Unknown score %s.\n", argv[argi+1]);
+				return 1;
+			}
+			score = entry->func;
+			argi++;
+		}
+		else if(!strcmp(argv[argi], "-dumplog") && argi+1<argc) {
+			replay_filename = argv[++argi];
+			dump_log = true;
+		}
+		else
+			break;
+	}
+	
+	// Rebuild a recorded map instead of generating one
+	if(replay_filename)
+	{
+		FILE *fin = fopen(replay_filename, "rb");
+		if(!fin || !read_log_header(fin)) {
+			fprintf(stderr, "Could not read event log %s.\n", replay_filename);
+			return 1;
+		}
+		if(dump_log && (map_filename || metrics_filename)) {
+			fprintf(stderr, "-dumplog prints records, not a map; it can't be combined with -binary, -rle or -metrics.\n");
+			return 1;
+		}
+		if(!dump_log)
+			init_map();
+		if(!replay_log(fin, dump_log ? stdout : NULL)) {
+			fprintf(stderr, "Event log %s is malformed.\n", replay_filename);
+			return 1;
+		}
+		fclose(fin);
+		if(dump_log)
+			return 0;
+		
+		print_map();
+		fflush(stdout);
+		if(map_filename && !write_map_file(map_filename, map_encoding)) {
+			fprintf(stderr, "Could not write map to %s.\n", map_filename);
+			return 1;
+		}
+		if(metrics_filename && !save_metrics(metrics_filename)) {
+			fprintf(stderr, "Could not write metrics to %s.\n", metrics_filename);
+			return 1;
+		}
+		return 0;
+	}
+	
+	if(!load_filename && argc-argi < 2) {
+		printf("Usage: %s [-caves] [-prefabs file] [-loops distance] [-record file] [-seed n]\n"
+		       "          [-entrance x,y]... [-strips n] [-bench runs] [-pagebench runs]\n"
+		       "          [-candidates n [-j threads] [-score floor|rooms|loops]] [-trace file.json]\n"
+		       "          [-binary file | -rle file] [-metrics file.json] (xsize ysize | -load map.txt [-extend x,y | -region x0,y0,x1,y1])\n"
+		       "       %s [-prefabs file] -replay file\n"
+		       "       %s -dumplog file\n", argv[0], argv[0], argv[0]);
+		return 1;
+	}
+	if(load_filename) {
+		if(candidates > 0 || num_strips > 1 || record_filename) {
+			fprintf(stderr, "-load can't be combined with -candidates, -strips or -record.\n");
+			return 1;
+		}
+		if(!load_map(load_filename)) {
+			fprintf(stderr, "Could not read map %s.\n", load_filename);
+			return 1;
+		}
+		if(have_region && (extend.x > 0 || extend.y > 0)) {
+			fprintf(stderr, "-region can't be combined with -extend.\n");
+			return 1;
+		}
+		if(have_region && (region[0] < 1 || region[1] < 1 || region[2] > size_x-1
+		                   || region[3] > size_y-1 || region[0] >= region[2] || region[1] >= region[3])) {
+			fprintf(stderr, "The region must be a non-empty rectangle inside the map's border.\n");
+			return 1;
+		}
+		if(extend.x > 0 || extend.y > 0)
+			extend_map(extend.x, extend.y);
+	} else if(have_region) {
+		fprintf(stderr, "-region needs a map from -load.\n");
+		return 1;
+	} else {
+		size_x     = atoi(argv[argi]);
+		size_y     = atoi(argv[argi+1]);
+	}
+	
+	for(size_t ii=0; ii<seed_points.size(); ii++) {
+		Vector pos = seed_points[ii];
+		if(pos.x<0 || pos.y<0 || pos.x>=size_x || pos.y>=size_y) {
+			fprintf(stderr, "Entrance %i,%i is outside the map.\n", pos.x, pos.y);
+			return 1;
+		}
+		if((pos.x==0 || pos.x==size_x-1) && (pos.y==0 || pos.y==size_y-1)) {
+			fprintf(stderr, "Entrance %i,%i is in a corner of the map.\n", pos.x, pos.y);
+			return 1;
+		}
+	}
+	bool default_entrance = seed_points.empty() && !load_filename;
+	if(default_entrance)
+		seed_points.push_back(Vector(size_x/2, size_y-1));
+	
+	// A seed on the border columns between strips can't be dug from by
+	// either, so move it a column into the strip whose border it's on. Then
+	// give every strip with no seed of its own one in its middle.
+	num_strips = std::max(1, std::min(num_strips, size_x/8));
+	for(size_t jj=0; jj<seed_points.size() && num_strips>1; jj++)
+	{
+		Vector &pos = seed_points[jj];
+		int left, right;
+		if(seed_strip(pos) >= 0)
+			continue;
+		for(int ii=0; ii<num_strips; ii++) {
+			strip_columns(ii, left, right);
+			if(pos.x == left || pos.x == right)
+				break;
+		}
+		Vector moved(pos.x == left ? pos.x+1 : pos.x-1, pos.y);
+		if(!default_entrance)
+			fprintf(stderr, "Entrance %i,%i is on a strip border; using %i,%i.\n", pos.x, pos.y, moved.x, moved.y);
+		pos = moved;
+	}
+	for(int ii=0; ii<num_strips && num_strips>1; ii++)
+	{
+		int left, right;
+		strip_columns(ii, left, right);
+		bool seeded = false;
+		for(size_t jj=0; jj<seed_points.size(); jj++)
+			seeded |= seed_strip(seed_points[jj]) == ii;
+		if(!seeded)
+			seed_points.push_back(Vector((left+right)/2, size_y/2));
+	}
+	
+	if(bench_runs > 0) {
+		benchmark(bench_runs, seed);
+		return 0;
+	}
+	if(page_bench_runs > 0) {
+		page_benchmark(page_bench_runs, seed);
+		return 0;
+	}
+	
+	rng_state = seed;
+	tracing = trace_filename != NULL;
+	
+	if((candidates > 0 || num_strips > 1) && record_filename) {
+		fprintf(stderr, "-candidates and -strips can't be combined with -record.\n");
+		return 1;
+	}
+	if(record_filename) {
+		event_log = fopen(record_filename, "wb");
+		if(!event_log) {
+			fprintf(stderr, "Could not open event log %s.\n", record_filename);
+			return 1;
+		}
+		log_header();
+	}
+	
+	if(candidates > 0)
+		best_of_candidates(candidates, seed, std::max(jobs, 1), score, loop_distance);
+	else
+	{
+		double start = now_seconds();
+		if(have_region)
+			regenerate_region(region[0], region[1], region[2], region[3]);
+		else if(frozen_x > 0) {
+			// Only the old map's last column and row can open into the new area
+			rebuild_frontier(frozen_x-1, 1, frozen_x, frozen_y);
+			rebuild_frontier(1, frozen_y-1, frozen_x-1, frozen_y);
+			seed_entrances();
+			dig_loop();
+		} else if(load_filename) {
+			// Carry on from every open edge of the loaded map
+			rebuild_frontier();
+			seed_entrances();
+			dig_loop();
+		} else {
+			init_map();
+			dig_map();
+		}
+		if(loop_distance > 0)
+			add_loops(loop_distance);
+		trace("generate", start, seed);
+	}
+	
+	if(event_log) {
+		log_end();
+		fclose(event_log);
+	}
+	
+	double start = now_seconds();
 	print_map();
+	fflush(stdout);
+	if(map_filename && !write_map_file(map_filename, map_encoding)) {
+		fprintf(stderr, "Could not write map to %s.\n", map_filename);
+		return 1;
+	}
+	trace("write", start);
+	
+	if(metrics_filename && !save_metrics(metrics_filename)) {
+		fprintf(stderr, "Could not write metrics to %s.\n", metrics_filename);
+		return 1;
+	}
+	if(trace_filename && !write_trace(trace_filename)) {
+		fprintf(stderr, "Could not write trace to %s.\n", trace_filename);
+		return 1;
+	}
 	return 0;
 }
 
@@ -27,6 +27,13 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 typedef struct
 {
@@ -47,9 +54,15 @@ void set_pixel(framebuffer *fb, unsigned x, unsigned y, int value)
 framebuffer *framebuffer_new(unsigned width, unsigned height)
 {
 	framebuffer *ret = (framebuffer*)malloc(sizeof(framebuffer));
+	if(!ret)
+		return NULL;
 	ret->width = width;
 	ret->height = height;
-	ret->data = (char*)malloc(width*height);
+	ret->data = (unsigned char*)malloc((size_t)width*height);
+	if(!ret->data) {
+		free(ret);
+		return NULL;
+	}
 	return ret;
 }
 
@@ -92,6 +105,9 @@ typedef struct
 	// pixel data follows header
 } TGA_HEADER;
 
+// The header holds the width and height in 16 bits
+#define TGA_MAX_SIZE 65535
+
 
 void save_tga(framebuffer *fb, FILE *fout, int left, int top, int right, int bottom)
 {
@@ -99,18 +115,20 @@ void save_tga(framebuffer *fb, FILE *fout, int left, int top, int right, int bot
 	    height = (bottom-top);
 	int x, y;
 	
-	int bufsiz = (right-left) * (bottom-top);
+	size_t bufsiz = (size_t)(right-left) * (bottom-top);
 	char *pixbuf = (char*)malloc(bufsiz);
 	
 	// Check preconditions
 	assert(right>left && bottom>top);
+	assert(width <= TGA_MAX_SIZE && height <= TGA_MAX_SIZE);
 	assert(fb);
 	assert(fout);
+	assert(pixbuf);
 	
 	// Collect pixel values from the framebuffer
 	for(x=left; x<right; x++)
 	for(y=top; y<bottom; y++)
-		pixbuf[y*width + x] = get_pixel(fb, x, y);
+		pixbuf[(size_t)y*width + x] = get_pixel(fb, x, y);
 	
 	// Write out data
 	TGA_HEADER tgaHead = {
@@ -126,133 +144,786 @@ void save_tga(framebuffer *fb, FILE *fout, int left, int top, int right, int bot
 
 
 
-const int tilesize_x = 5,
-          tilesize_y = 5;
-
-framebuffer tile_wall = {
-	5, 5,
-	"#####"
-	"#####"
-	"#####"
-	"#####"
-	"#####" };
-framebuffer tile_space = {
-	5, 5,
-	"====="
-	"====="
-	"====="
-	"====="
-	"=====" };
-framebuffer tile_dot = {
-	5, 5,
-	"     "
-	"     "
-	"     "
-	"  -  "
-	"     " };
-framebuffer tile_plus = {
-	5, 5,
-	"     "
-	"  #  "
-	" ### "
-	"  #  "
-	"     " };
-framebuffer tile_question = {
-	5, 5,
-	" ##  "
-	"   # "
-	"  #  "
-	"     "
-	"  #  " };
-
-void init_tile(framebuffer *tile)
-{
-	int ii, jj, v;
-	
-	for(ii=0; ii<tile->height; ii++)
-	for(jj=0; jj<tile->width; jj++)
+// PNG output. Everything is done here so that imagifier needs no libraries:
+// CRC-32 for the chunks, Adler-32 for the zlib stream, and a deflate encoder
+// that writes either stored blocks or fixed-Huffman blocks. Nearly all of the
+// redundancy in a rendered map is long runs of one grey level, tiles that
+// repeat the tile beside them, and scanlines that repeat the one above, so
+// instead of a general hash-chain search the match finder only tries three
+// distances: 1 (runs), the tile width, and the scanline stride.
+//
+// The image is split into horizontal bands which are filtered and compressed
+// by separate threads. Every band but the last ends with a sync flush, an
+// empty non-final stored block that byte-aligns it, so the bands' outputs
+// can simply be written one after another as IDAT chunks. Matches never reach back across a band
+// boundary, so each band is a valid continuation of the stream before it.
+
+#define PNG_STORED 0
+#define PNG_FIXED  1
+
+typedef struct
+{
+	unsigned char *data;
+	size_t len, cap;
+	unsigned long bits;
+	int nbits;
+} bytebuf;
+
+static unsigned long crc_table[256];
+static unsigned short fixed_code[288];
+static unsigned char fixed_code_len[288];
+
+static const unsigned short length_base[29] = {
+	3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,
+	35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const unsigned char length_extra[29] = {
+	0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,
+	3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const unsigned short dist_base[30] = {
+	1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+	257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const unsigned char dist_extra[30] = {
+	0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,
+	7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+
+// Huffman codes are defined MSB-first but deflate packs bits LSB-first, so
+// the fixed code table is stored bit-reversed.
+static unsigned reverse_bits(unsigned value, int count)
+{
+	unsigned ret = 0;
+	int ii;
+	for(ii=0; ii<count; ii++)
+		ret = (ret<<1) | ((value>>ii)&1);
+	return ret;
+}
+
+void init_png_tables(void)
+{
+	unsigned long c;
+	int n, k;
+	
+	for(n=0; n<256; n++) {
+		c = n;
+		for(k=0; k<8; k++)
+			c = (c&1) ? 0xEDB88320UL^(c>>1) : c>>1;
+		crc_table[n] = c;
+	}
+	for(n=0; n<288; n++) {
+		if(n < 144)      { fixed_code_len[n]=8; c = 0x30 + n; }
+		else if(n < 256) { fixed_code_len[n]=9; c = 0x190 + n-144; }
+		else if(n < 280) { fixed_code_len[n]=7; c = n-256; }
+		else             { fixed_code_len[n]=8; c = 0xC0 + n-280; }
+		fixed_code[n] = reverse_bits(c, fixed_code_len[n]);
+	}
+}
+
+unsigned long update_crc(unsigned long crc, const unsigned char *buf, size_t len)
+{
+	size_t ii;
+	for(ii=0; ii<len; ii++)
+		crc = crc_table[(crc^buf[ii]) & 0xff] ^ (crc>>8);
+	return crc;
+}
+
+unsigned long update_adler32(unsigned long adler, const unsigned char *buf, size_t len)
+{
+	unsigned long a = adler & 0xffff, b = adler >> 16;
+	size_t n;
+	
+	// 5552 is the most bytes that can be summed before b overflows 32 bits
+	while(len > 0) {
+		n = len<5552 ? len : 5552;
+		len -= n;
+		while(n--) {
+			a += *buf++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b<<16) | a;
+}
+
+void put_byte(bytebuf *buf, int value)
+{
+	if(buf->len == buf->cap) {
+		buf->cap = buf->cap ? buf->cap*2 : 4096;
+		buf->data = (unsigned char*)realloc(buf->data, buf->cap);
+	}
+	buf->data[buf->len++] = value;
+}
+
+void put_bits(bytebuf *buf, unsigned long value, int count)
+{
+	buf->bits |= value << buf->nbits;
+	buf->nbits += count;
+	while(buf->nbits >= 8) {
+		put_byte(buf, buf->bits & 0xff);
+		buf->bits >>= 8;
+		buf->nbits -= 8;
+	}
+}
+
+void align_bits(bytebuf *buf)
+{
+	if(buf->nbits > 0)
+		put_bits(buf, 0, 8-buf->nbits);
+}
+
+void put_be32(bytebuf *buf, unsigned long value)
+{
+	put_byte(buf, (value>>24) & 0xff);
+	put_byte(buf, (value>>16) & 0xff);
+	put_byte(buf, (value>>8)  & 0xff);
+	put_byte(buf, value & 0xff);
+}
+
+void put_symbol(bytebuf *buf, int symbol)
+{
+	put_bits(buf, fixed_code[symbol], fixed_code_len[symbol]);
+}
+
+void put_match(bytebuf *buf, int length, int distance)
+{
+	int sym;
+	
+	for(sym=28; length_base[sym] > length; sym--);
+	put_symbol(buf, 257+sym);
+	put_bits(buf, length-length_base[sym], length_extra[sym]);
+	
+	for(sym=29; dist_base[sym] > distance; sym--);
+	put_bits(buf, reverse_bits(sym, 5), 5);
+	put_bits(buf, distance-dist_base[sym], dist_extra[sym]);
+}
+
+void deflate_stored(bytebuf *out, const unsigned char *data, size_t len, int final)
+{
+	size_t n;
+	
+	do {
+		n = len<65535 ? len : 65535;
+		put_bits(out, final && n==len, 1);
+		put_bits(out, 0, 2);
+		align_bits(out);
+		put_bits(out, n, 16);
+		put_bits(out, n ^ 0xffff, 16);
+		for(len-=n; n>0; n--)
+			put_byte(out, *data++);
+	} while(len > 0);
+}
+
+void deflate_fixed(bytebuf *out, const unsigned char *data, size_t len, size_t period, size_t stride, int final)
+{
+	size_t distances[3] = { 1, period, stride };
+	size_t pos = 0, max, run, best, best_distance;
+	int ii;
+	
+	put_bits(out, final, 1);
+	put_bits(out, 1, 2);
+	
+	while(pos < len)
+	{
+		max = len-pos < 258 ? len-pos : 258;
+		best = best_distance = 0;
+		for(ii=0; ii<3; ii++)
+		{
+			if(distances[ii]>32768 || distances[ii]>pos)
+				continue;
+			for(run=0; run<max && data[pos+run]==data[pos+run-distances[ii]]; run++);
+			if(run > best) {
+				best = run;
+				best_distance = distances[ii];
+			}
+		}
+		
+		if(best >= 3) {
+			put_match(out, best, best_distance);
+			pos += best;
+		} else {
+			put_symbol(out, data[pos++]);
+		}
+	}
+	put_symbol(out, 256);
+}
+
+int paeth(int a, int b, int c)
+{
+	int p = a+b-c;
+	int pa = abs(p-a), pb = abs(p-b), pc = abs(p-c);
+	if(pa<=pb && pa<=pc) return a;
+	if(pb<=pc) return b;
+	return c;
+}
+
+// Apply each of the five PNG filters to a scanline and keep the one whose
+// output has the smallest sum of absolute values (taken as signed bytes),
+// which is the usual heuristic. Filtered rows are written with their
+// leading filter-type byte.
+void filter_row(unsigned char *out, const unsigned char *row, const unsigned char *prev, int width, unsigned char *scratch)
+{
+	int filter, x, a, b, c, v;
+	long cost, best_cost = -1;
+	
+	for(filter=0; filter<5; filter++)
+	{
+		cost = 0;
+		for(x=0; x<width; x++)
+		{
+			a = x>0 ? row[x-1] : 0;
+			b = prev ? prev[x] : 0;
+			c = (x>0 && prev) ? prev[x-1] : 0;
+			switch(filter) {
+				case 0: v = row[x]; break;
+				case 1: v = row[x]-a; break;
+				case 2: v = row[x]-b; break;
+				case 3: v = row[x]-((a+b)>>1); break;
+				default: v = row[x]-paeth(a, b, c); break;
+			}
+			scratch[x] = v;
+			cost += abs((signed char)scratch[x]);
+		}
+		if(best_cost<0 || cost<best_cost) {
+			best_cost = cost;
+			out[0] = filter;
+			memcpy(out+1, scratch, width);
+		}
+	}
+}
+
+typedef struct
+{
+	framebuffer *fb;
+	int left, width, top, bottom;
+	int method, period, final;
+	unsigned char *filtered;
+	bytebuf out;
+} png_band;
+
+void *compress_band(void *arg)
+{
+	png_band *band = (png_band*)arg;
+	size_t stride = band->width+1;
+	size_t len = stride * (band->bottom-band->top);
+	unsigned char *scratch = (unsigned char*)malloc(band->width);
+	const unsigned char *row, *prev;
+	int y;
+	
+	band->filtered = (unsigned char*)malloc(len);
+	for(y=band->top; y<band->bottom; y++)
+	{
+		row = band->fb->data + (size_t)y*band->fb->width + band->left;
+		prev = y>0 ? row-band->fb->width : NULL;
+		filter_row(band->filtered + (y-band->top)*stride, row, prev, band->width, scratch);
+	}
+	free(scratch);
+	
+	if(band->method == PNG_STORED)
+		deflate_stored(&band->out, band->filtered, len, band->final);
+	else
+		deflate_fixed(&band->out, band->filtered, len, band->period, stride, band->final);
+	
+	// Sync-flush so the next band starts on a byte boundary
+	if(!band->final) {
+		put_bits(&band->out, 0, 3);
+		align_bits(&band->out);
+		put_bits(&band->out, 0xffff0000UL, 32);
+	}
+	align_bits(&band->out);
+	return NULL;
+}
+
+void write_chunk(FILE *fout, const char *type, const unsigned char *data, size_t len)
+{
+	unsigned char len_bytes[4] = { len>>24, len>>16, len>>8, len };
+	unsigned long crc = update_crc(0xffffffffUL, (const unsigned char*)type, 4);
+	unsigned char crc_bytes[4];
+	
+	crc = update_crc(crc, data, len) ^ 0xffffffffUL;
+	crc_bytes[0] = crc>>24; crc_bytes[1] = crc>>16; crc_bytes[2] = crc>>8; crc_bytes[3] = crc;
+	fwrite(len_bytes, 4, 1, fout);
+	fwrite(type, 4, 1, fout);
+	if(len > 0)
+		fwrite(data, len, 1, fout);
+	fwrite(crc_bytes, 4, 1, fout);
+}
+
+void save_png(framebuffer *fb, FILE *fout, int left, int top, int right, int bottom, int method, int period, int jobs)
+{
+	static const unsigned char signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+	int width = (right-left),
+	    height = (bottom-top);
+	int num_bands, band_height, ii;
+	png_band *bands;
+	pthread_t *threads;
+	unsigned long adler = 1;
+	bytebuf header = {0};
+	
+	// Check preconditions
+	assert(right>left && bottom>top);
+	assert(fb);
+	assert(fout);
+	
+	// Bands shorter than a few dozen rows waste too much on flush blocks
+	num_bands = jobs>1 ? jobs : 1;
+	if(num_bands > height/32)
+		num_bands = height/32 > 0 ? height/32 : 1;
+	band_height = (height+num_bands-1) / num_bands;
+	
+	bands = (png_band*)calloc(num_bands, sizeof(png_band));
+	threads = (pthread_t*)malloc(sizeof(pthread_t) * num_bands);
+	for(ii=0; ii<num_bands; ii++)
+	{
+		bands[ii].fb = fb;
+		bands[ii].left = left;
+		bands[ii].width = width;
+		bands[ii].top = top + ii*band_height;
+		bands[ii].bottom = bands[ii].top+band_height < bottom ? bands[ii].top+band_height : bottom;
+		bands[ii].method = method;
+		bands[ii].period = period;
+		bands[ii].final = (ii == num_bands-1);
+		pthread_create(&threads[ii], NULL, compress_band, &bands[ii]);
+	}
+	
+	fwrite(signature, sizeof signature, 1, fout);
+	put_be32(&header, width);
+	put_be32(&header, height);
+	put_byte(&header, 8);   // bit depth
+	put_byte(&header, 0);   // greyscale
+	put_byte(&header, 0);   // deflate
+	put_byte(&header, 0);   // adaptive filtering
+	put_byte(&header, 0);   // no interlace
+	write_chunk(fout, "IHDR", header.data, header.len);
+	
+	// zlib header: deflate with a 32K window, no dictionary, check bits set
+	header.len = 0;
+	put_byte(&header, 0x78);
+	put_byte(&header, 0x01);
+	write_chunk(fout, "IDAT", header.data, header.len);
+	
+	// Write bands in order as they finish
+	for(ii=0; ii<num_bands; ii++)
+	{
+		pthread_join(threads[ii], NULL);
+		adler = update_adler32(adler, bands[ii].filtered, (size_t)(width+1) * (bands[ii].bottom-bands[ii].top));
+		write_chunk(fout, "IDAT", bands[ii].out.data, bands[ii].out.len);
+		free(bands[ii].filtered);
+		free(bands[ii].out.data);
+	}
+	
+	header.len = 0;
+	put_be32(&header, adler);
+	write_chunk(fout, "IDAT", header.data, header.len);
+	write_chunk(fout, "IEND", NULL, 0);
+	
+	free(header.data);
+	free(bands);
+	free(threads);
+}
+
+
+// Tile sets. A tile set is text: a "size width height" line, then any
+// number of "shade c value" lines giving the grey level drawn for art
+// character c, and "tile keys" lines each followed by height rows of art.
+// The keys are the map characters the tile is drawn for, or "space", or
+// "default" for characters with no tile of their own (without a default,
+// the first tile is used). Art rows shorter than the width are padded with
+// spaces, and lines starting with ';' are comments. Art characters with no
+// shade default to ' ' 255, '-' 128, '#' 0, '=' 95, and 128 otherwise.
+//
+// At load time the glyphs are compiled into one strip per pixel row, holding
+// that row of every glyph side by side, plus a note of which glyph rows are
+// a single value; the renderer then only needs a character-to-glyph lookup
+// and a copy or a fill per run of cells. The built-in tiles go through the
+// same loader, so a custom tile set renders exactly as fast.
+const char *builtin_tiles =
+	"size 5 5\n"
+	"tile #\n"
+	"#####\n" "#####\n" "#####\n" "#####\n" "#####\n"
+	"tile space\n"
+	"=====\n" "=====\n" "=====\n" "=====\n" "=====\n"
+	"tile .\n"
+	"     \n" "     \n" "     \n" "  -  \n" "     \n"
+	"tile +\n"
+	"     \n" "  #  \n" " ### \n" "  #  \n" "     \n"
+	"tile default\n"
+	" ##  \n" "   # \n" "  #  \n" "     \n" "  #  \n";
+
+typedef struct
+{
+	int num_glyphs;
+	int glyph_of[256];       // Which glyph each map character is drawn with
+	unsigned char *strips;   // Row gy of glyph g is at ((gy*num_glyphs)+g)*tilesize_x
+	short *fill;             // fill[gy*num_glyphs+g] is that row's value if it's uniform, else -1
+} tileset;
+
+int tilesize_x, tilesize_y;
+tileset tiles;
+
+// Parse a tile set from #text, reporting errors against #name. Return 0 if
+// it's malformed.
+int load_tileset(const char *text, const char *name)
+{
+	int shade[256];
+	int key_glyph[256];
+	char *art = NULL;           // num_glyphs glyphs of tilesize_y rows, as art characters
+	int num_glyphs = 0, default_glyph = -1, rows_left = 0;
+	int line_num = 0, len, ii, gy, xi, v;
+	const char *line, *next;
+	char keys[256];
+	
+	for(ii=0; ii<256; ii++) {
+		shade[ii] = 128;
+		key_glyph[ii] = -1;
+	}
+	shade[' '] = 255; shade['-'] = 128; shade['#'] = 0; shade['='] = 95;
+	tilesize_x = tilesize_y = 0;
+	
+	for(line=text; *line; line=next)
 	{
-		v = get_pixel(tile, jj, ii);
-		switch(v) {
-			case ' ': v=255; break;
-			case '-': v=128; break;
-			case '#': v=0;   break;
-			case '=': v=95;  break;
-			default:  v=128; break;
+		next = strchr(line, '\n');
+		len = next ? next-line : (int)strlen(line);
+		next = next ? next+1 : line+len;
+		if(len>0 && line[len-1]=='\r')
+			len--;
+		line_num++;
+		
+		if(rows_left > 0)
+		{
+			if(len > tilesize_x) {
+				fprintf(stderr, "%s:%i: Art row is wider than %i.\n", name, line_num, tilesize_x);
+				goto fail;
+			}
+			gy = tilesize_y - rows_left--;
+			memset(art + ((size_t)(num_glyphs-1)*tilesize_y + gy)*tilesize_x, ' ', tilesize_x);
+			memcpy(art + ((size_t)(num_glyphs-1)*tilesize_y + gy)*tilesize_x, line, len);
+			continue;
+		}
+		if(len==0 || line[0]==';')
+			continue;
+		
+		if(sscanf(line, "size %i %i", &tilesize_x, &tilesize_y) == 2)
+		{
+			if(tilesize_x<1 || tilesize_y<1 || num_glyphs>0) {
+				fprintf(stderr, "%s:%i: Bad or misplaced size.\n", name, line_num);
+				goto fail;
+			}
 		}
-		set_pixel(tile, jj, ii, v);
+		else if(len>=9 && !strncmp(line, "shade ", 6))
+		{
+			if(sscanf(line+8, "%i", &v)!=1 || v<0 || v>255) {
+				fprintf(stderr, "%s:%i: Shades are 0 to 255.\n", name, line_num);
+				goto fail;
+			}
+			shade[(unsigned char)line[6]] = v;
+		}
+		else if(len>=6 && !strncmp(line, "tile ", 5))
+		{
+			if(tilesize_x < 1) {
+				fprintf(stderr, "%s:%i: Tiles must come after the size.\n", name, line_num);
+				goto fail;
+			}
+			snprintf(keys, sizeof keys, "%.*s", len-5, line+5);
+			if(!strcmp(keys, "default"))
+				default_glyph = num_glyphs;
+			else if(!strcmp(keys, "space"))
+				key_glyph[' '] = num_glyphs;
+			else for(ii=0; keys[ii]; ii++)
+				key_glyph[(unsigned char)keys[ii]] = num_glyphs;
+			num_glyphs++;
+			art = (char*)realloc(art, (size_t)num_glyphs*tilesize_x*tilesize_y);
+			rows_left = tilesize_y;
+		}
+		else
+		{
+			fprintf(stderr, "%s:%i: Expected size, shade or tile.\n", name, line_num);
+			goto fail;
+		}
+	}
+	if(rows_left > 0 || num_glyphs == 0) {
+		fprintf(stderr, "%s: %s.\n", name, num_glyphs ? "Last tile is missing rows" : "No tiles");
+		goto fail;
+	}
+	
+	// Compile the glyphs into per-row strips
+	free(tiles.strips);
+	free(tiles.fill);
+	tiles.num_glyphs = num_glyphs;
+	tiles.strips = (unsigned char*)malloc((size_t)num_glyphs*tilesize_x*tilesize_y);
+	tiles.fill = (short*)malloc(sizeof(short) * num_glyphs*tilesize_y);
+	for(ii=0; ii<256; ii++)
+		tiles.glyph_of[ii] = key_glyph[ii]>=0 ? key_glyph[ii] : default_glyph>=0 ? default_glyph : 0;
+	for(ii=0; ii<num_glyphs; ii++)
+	for(gy=0; gy<tilesize_y; gy++)
+	{
+		const char *src = art + ((size_t)ii*tilesize_y + gy)*tilesize_x;
+		unsigned char *dest = tiles.strips + ((size_t)gy*num_glyphs + ii)*tilesize_x;
+		for(xi=0; xi<tilesize_x; xi++)
+			dest[xi] = shade[(unsigned char)src[xi]];
+		for(xi=1; xi<tilesize_x && dest[xi]==dest[0]; xi++);
+		tiles.fill[gy*num_glyphs + ii] = xi==tilesize_x ? dest[0] : -1;
 	}
+	free(art);
+	return 1;
+	
+fail:
+	free(art);
+	return 0;
 }
 
-void init_all_tiles(void)
+// Read a tile set file. Return 0 if it can't be read or is malformed.
+int load_tileset_file(const char *filename)
 {
-	init_tile(&tile_wall);
-	init_tile(&tile_space);
-	init_tile(&tile_dot);
-	init_tile(&tile_plus);
-	init_tile(&tile_question);
+	FILE *fin = fopen(filename, "rb");
+	char *text;
+	long len;
+	int ret;
+	
+	if(!fin)
+		return 0;
+	fseek(fin, 0, SEEK_END);
+	len = ftell(fin);
+	fseek(fin, 0, SEEK_SET);
+	text = (char*)malloc(len+1);
+	len = fread(text, 1, len, fin);
+	text[len] = 0;
+	fclose(fin);
+	
+	ret = load_tileset(text, filename);
+	free(text);
+	return ret;
 }
 
-framebuffer *get_tile(char tile)
+// Draw #count copies of #tile side by side, starting at map cell (x,y).
+// Glyph rows that are all one value, which is most of them, are drawn
+// across the whole run with a single memset.
+void render_run(framebuffer *fb, int x, int y, unsigned char tile, size_t count)
 {
-	switch(tile)
+	int glyph = tiles.glyph_of[tile];
+	const unsigned char *src;
+	unsigned char *dest;
+	int gy, fill;
+	size_t nn;
+	
+	for(gy=0; gy<tilesize_y; gy++)
 	{
-		case '#': return &tile_wall;
-		case ' ': return &tile_space;
-		case '.': return &tile_dot;
-		case '+': return &tile_plus;
-		default:  return &tile_question;
+		src = tiles.strips + ((size_t)gy*tiles.num_glyphs + glyph)*tilesize_x;
+		dest = fb->data + ((size_t)y*tilesize_y + gy)*fb->width + (size_t)x*tilesize_x;
+		fill = tiles.fill[gy*tiles.num_glyphs + glyph];
+		if(fill >= 0)
+			memset(dest, fill, count*tilesize_x);
+		else for(nn=0; nn<count; nn++)
+			memcpy(dest + nn*tilesize_x, src, tilesize_x);
 	}
 }
 
+// Draw a row of map cells, a run of identical cells at a time.
+void render_row(framebuffer *fb, int y, const unsigned char *row, size_t width)
+{
+	size_t xi, start;
+	
+	for(xi=0; xi<width; )
+	{
+		start = xi;
+		while(xi<width && row[xi]==row[start])
+			xi++;
+		render_run(fb, start, y, row[start], xi-start);
+	}
+}
+
+// Make a framebuffer for a map of #width by #height cells. Return NULL if
+// the image's size in pixels doesn't fit in an int, or it's too big to
+// allocate.
+framebuffer *framebuffer_for_map(unsigned long width, unsigned long height)
+{
+	if(!width || !height || width > (unsigned)(INT_MAX/tilesize_x) || height > (unsigned)(INT_MAX/tilesize_y)
+	   || width*tilesize_x > SIZE_MAX / (height*tilesize_y))
+		return NULL;
+	return framebuffer_new(width*tilesize_x, height*tilesize_y);
+}
+
+// Map files, as written by Cave and digger3 with -binary or -rle: a 16-byte
+// header ("MAPF", then width, height and encoding as little-endian 32-bit
+// words), then each row's cells as the characters the ASCII map would have,
+// either one byte per cell (encoding 0) or as runs of a byte followed by a
+// LEB128 count (encoding 1) that never cross the end of a row. The file is
+// mapped rather than read, and the image is built a run at a time, so there
+// is no text to parse.
+unsigned long get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1]<<8) | (p[2]<<16) | ((unsigned long)p[3]<<24);
+}
+
+// Read a varint from *pos, not going past #end. Return 0 if it's truncated.
+int get_varint(const unsigned char **pos, const unsigned char *end, size_t *value)
+{
+	int shift = 0;
+	
+	*value = 0;
+	while(*pos < end && shift < 64)
+	{
+		unsigned char byte = *(*pos)++;
+		*value |= (size_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+// Render a map file into a new framebuffer. Return NULL if the file can't
+// be read or is malformed, or the image would be too big.
+framebuffer *render_map_file(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+	const unsigned char *data, *pos, *end;
+	unsigned long width, height, encoding;
+	size_t xi, yi, start, count;
+	framebuffer *fb = NULL;
+	
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || st.st_size < 16) {
+		close(fd);
+		return NULL;
+	}
+	data = (const unsigned char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED)
+		return NULL;
+	madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+	end = data + st.st_size;
+	
+	width = get_le32(data+4);
+	height = get_le32(data+8);
+	encoding = get_le32(data+12);
+	if(memcmp(data, "MAPF", 4) || !width || !height || encoding > 1
+	   || (encoding == 0 && (size_t)(end-data-16) / width < height))
+		goto done;
+	
+	fb = framebuffer_for_map(width, height);
+	if(!fb)
+		goto done;
+	pos = data + 16;
+	for(yi=0; yi<height; yi++)
+	{
+		if(encoding == 0) {
+			render_row(fb, yi, pos + yi*width, width);
+			continue;
+		}
+		for(xi=0; xi<width; xi+=count)
+		{
+			if(pos == end)
+				goto malformed;
+			start = *pos++;
+			if(!get_varint(&pos, end, &count) || count==0 || count > width-xi)
+				goto malformed;
+			render_run(fb, xi, yi, start, count);
+		}
+	}
+	goto done;
+	
+malformed:
+	free(fb->data);
+	free(fb);
+	fb = NULL;
+done:
+	munmap((void*)data, st.st_size);
+	return fb;
+}
 
 
 int main(int argc, char **argv)
 {
-	const char *out_filename = NULL;
+	const char *out_filename = NULL, *map_filename = NULL;
 	int size_x=0, size_y=0;
+	const char *tiles_filename = NULL;
 	int ii, jj;
-	char line_inbuf[512];
-	char **tilebuf;
+	size_t len;
+	int argi = 1;
+	int png = 0, png_method = PNG_FIXED;
+	int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	char *line_inbuf;
 	framebuffer *fb;
 	FILE *fout;
 	
-	if(argc < 2) {
-		fprintf(stderr, "Usage: %s [-o filename] size_x size_y\n", argv[0]);
+	for(; argi<argc && argv[argi][0]=='-'; argi++)
+	{
+		if(!strcmp(argv[argi], "-o") && argi+1<argc)
+			out_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-map") && argi+1<argc)
+			map_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-tiles") && argi+1<argc)
+			tiles_filename = argv[++argi];
+		else if(!strcmp(argv[argi], "-png"))
+			png = 1;
+		else if(!strcmp(argv[argi], "-stored"))
+			png_method = PNG_STORED;
+		else if(!strcmp(argv[argi], "-j") && argi+1<argc)
+			jobs = atoi(argv[++argi]);
+		else
+			break;
+	}
+	if(!map_filename && argc-argi < 2) {
+		fprintf(stderr, "Usage: %s [-o filename] [-tiles file] [-png [-stored] [-j threads]] size_x size_y\n"
+		                "       %s [-o filename] [-tiles file] [-png [-stored] [-j threads]] -map file\n", argv[0], argv[0]);
+		return 1;
+	}
+	
+	// Pick PNG from the output file's extension too
+	if(out_filename && strlen(out_filename)>4 && !strcmp(out_filename+strlen(out_filename)-4, ".png"))
+		png = 1;
+	
+	if(tiles_filename ? !load_tileset_file(tiles_filename) : !load_tileset(builtin_tiles, "built-in tiles")) {
+		fprintf(stderr, "Could not load tile set %s.\n", tiles_filename ? tiles_filename : "");
 		return 1;
 	}
 	
-	if(!strcmp(argv[1], "-o")) {
-		if(argc < 5) {
-			fprintf(stderr, "Not enough arguments.\n");
+	if(map_filename)
+	{
+		fb = render_map_file(map_filename);
+		if(!fb) {
+			fprintf(stderr, "Could not read map file %s.\n", map_filename);
 			return 1;
 		}
-		out_filename = argv[2];
-		size_x = atoi(argv[3]);
-		size_y = atoi(argv[4]);
-	} else {
-		size_x = atoi(argv[1]);
-		size_y = atoi(argv[2]);
 	}
-	assert(size_x < 512);
-	
-	tilebuf = (char**)malloc( sizeof(char*) * size_y );
-	for(ii=0; ii<size_y; ii++)
-		tilebuf[ii] = (char*)malloc(sizeof(char*) * size_x);
-	
-	for(ii=0; ii<size_y; ii++)
+	else
 	{
-		fgets(line_inbuf, 512, stdin);
-		memcpy(tilebuf[ii], line_inbuf, size_x);
+		size_x = atoi(argv[argi]);
+		size_y = atoi(argv[argi+1]);
+		if(size_x < 1 || size_y < 1) {
+			fprintf(stderr, "Map size must be positive.\n");
+			return 1;
+		}
+		fb = framebuffer_for_map(size_x, size_y);
+		if(!fb) {
+			fprintf(stderr, "Map is too big to render.\n");
+			return 1;
+		}
+		
+		// Short or missing lines are drawn as unknown (blank) cells
+		line_inbuf = (char*)malloc(size_x+2);
+		for(ii=0; ii<size_y; ii++)
+		{
+			if(!fgets(line_inbuf, size_x+2, stdin))
+				line_inbuf[0] = 0;
+			
+			// Skip the rest of a line that's longer than the map
+			if(!strchr(line_inbuf, '\n'))
+				while((jj=getchar())!=EOF && jj!='\n');
+			len = strcspn(line_inbuf, "\r\n");
+			if(len > (size_t)size_x)
+				len = size_x;
+			memset(line_inbuf+len, ' ', size_x-len);
+			render_row(fb, ii, (unsigned char*)line_inbuf, size_x);
+		}
+		free(line_inbuf);
 	}
 	
-	fb = framebuffer_new(size_x*tilesize_x, size_y*tilesize_y);
-	init_all_tiles();
-	
-	for(ii=0; ii<size_y; ii++)
-	for(jj=0; jj<size_x; jj++)
-	{
-		blit(fb, get_tile(tilebuf[ii][jj]), jj*tilesize_x, ii*tilesize_y, tilesize_x, tilesize_y);
+	if(!png && (fb->width > TGA_MAX_SIZE || fb->height > TGA_MAX_SIZE)) {
+		fprintf(stderr, "Image is %ux%u, too big for TGA (at most %i a side); use -png.\n",
+		        fb->width, fb->height, TGA_MAX_SIZE);
+		return 1;
 	}
 	
 	if(out_filename)
@@ -263,7 +934,12 @@ int main(int argc, char **argv)
 		fprintf(stderr, "Could not open output file.\n");
 		return 1;
 	}
-	save_tga(fb, fout, 0, 0, fb->width, fb->height);
+	if(png) {
+		init_png_tables();
+		save_png(fb, fout, 0, 0, fb->width, fb->height, png_method, tilesize_x, jobs);
+	} else {
+		save_tga(fb, fout, 0, 0, fb->width, fb->height);
+	}
 	fclose(fout);
 	
 	return 0;
@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2026 The Random Cave Tutorials contributors
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ * 
+ * 
+ */
+// mapdiff: Make a compact patch between two versions of a map, and apply it
+// to the old version in place. Works on the maps printed by Cave and the
+// Digger programs (or any other file), so only the cells that changed need
+// to be sent when a level is regenerated or edited.
+//
+// A patch is the bytes "MDIF", the old and new file lengths, and then a list
+// of runs. Each run is the number of unchanged bytes since the end of the
+// previous run, the length of the run, and the new bytes. A run of length 0
+// ends the list. All numbers are unsigned LEB128 varints.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Changed runs separated by fewer unchanged bytes than this are merged,
+// since a run header costs about as much as the bytes it would skip.
+#define MERGE_GAP 4
+
+typedef struct
+{
+	unsigned char *data;
+	size_t length, capacity;
+} patchbuf;
+
+void patch_put(patchbuf *buf, const void *data, size_t length)
+{
+	if(buf->length + length > buf->capacity) {
+		buf->capacity = (buf->length + length) * 2;
+		buf->data = (unsigned char*)realloc(buf->data, buf->capacity);
+	}
+	memcpy(buf->data + buf->length, data, length);
+	buf->length += length;
+}
+
+void patch_put_varint(patchbuf *buf, uint64_t value)
+{
+	unsigned char bytes[10];
+	int count = 0;
+	
+	do {
+		bytes[count] = value & 0x7f;
+		value >>= 7;
+		if(value)
+			bytes[count] |= 0x80;
+		count++;
+	} while(value);
+	patch_put(buf, bytes, count);
+}
+
+// Read a varint from *pos, not going past #end. Return 0 if it's truncated.
+int patch_get_varint(const unsigned char **pos, const unsigned char *end, uint64_t *value)
+{
+	int shift = 0;
+	
+	*value = 0;
+	while(*pos < end && shift < 64)
+	{
+		unsigned char byte = *(*pos)++;
+		*value |= (uint64_t)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return 1;
+		shift += 7;
+	}
+	return 0;
+}
+
+// Return the first index from #start on where #a and #b differ, or #length
+// if they're the same to the end. Compares a word at a time, so identical
+// spans are skipped eight bytes per step.
+size_t find_difference(const unsigned char *a, const unsigned char *b, size_t start, size_t length)
+{
+	size_t ii = start;
+	
+	for(; ii+8 <= length; ii+=8)
+	{
+		uint64_t wa, wb;
+		memcpy(&wa, a+ii, 8);
+		memcpy(&wb, b+ii, 8);
+		if(wa != wb) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+			return ii + __builtin_ctzll(wa ^ wb) / 8;
+#else
+			return ii + __builtin_clzll(wa ^ wb) / 8;
+#endif
+		}
+	}
+	for(; ii<length; ii++)
+		if(a[ii] != b[ii])
+			return ii;
+	return length;
+}
+
+// Build a patch that turns #old_map into #new_map. Return its length, with
+// the patch itself (allocated with malloc) in *patch.
+size_t map_diff(const unsigned char *old_map, size_t old_length,
+                const unsigned char *new_map, size_t new_length,
+                unsigned char **patch)
+{
+	patchbuf buf = { NULL, 0, 0 };
+	size_t common = old_length<new_length ? old_length : new_length;
+	size_t pos = 0, start, end;
+	
+	patch_put(&buf, "MDIF", 4);
+	patch_put_varint(&buf, old_length);
+	patch_put_varint(&buf, new_length);
+	
+	for(;;)
+	{
+		start = find_difference(old_map, new_map, pos, common);
+		if(start == common)
+			break;
+		
+		// Extend the run until there's a long enough unchanged span after it
+		end = start+1;
+		for(;;)
+		{
+			while(end < common && old_map[end] != new_map[end])
+				end++;
+			size_t next = find_difference(old_map, new_map, end, common);
+			if(next == common || next-end >= MERGE_GAP)
+				break;
+			end = next;
+		}
+		
+		patch_put_varint(&buf, start-pos);
+		patch_put_varint(&buf, end-start);
+		patch_put(&buf, new_map+start, end-start);
+		pos = end;
+	}
+	
+	// Anything past the end of the old map is one more run
+	if(new_length > common) {
+		patch_put_varint(&buf, common-pos);
+		patch_put_varint(&buf, new_length-common);
+		patch_put(&buf, new_map+common, new_length-common);
+	}
+	patch_put_varint(&buf, 0);
+	patch_put_varint(&buf, 0);
+	
+	*patch = buf.data;
+	return buf.length;
+}
+
+// Walk the runs in #patch, calling #apply for each. Return 0 if the patch is
+// malformed or #apply fails, or 1 on success, with the new length in
+// *new_length.
+typedef int (*apply_func)(void *target, size_t offset, const unsigned char *data, size_t length);
+
+int map_patch_walk(const unsigned char *patch, size_t patch_length, size_t old_length,
+                   size_t *new_length, apply_func apply, void *target)
+{
+	const unsigned char *pos = patch+4, *end = patch+patch_length;
+	uint64_t header_old, header_new, skip, length;
+	size_t offset = 0;
+	
+	if(patch_length < 4 || memcmp(patch, "MDIF", 4))
+		return 0;
+	if(!patch_get_varint(&pos, end, &header_old) || !patch_get_varint(&pos, end, &header_new))
+		return 0;
+	if(header_old != old_length)
+		return 0;
+	
+	for(;;)
+	{
+		if(!patch_get_varint(&pos, end, &skip) || !patch_get_varint(&pos, end, &length))
+			return 0;
+		if(length == 0)
+			break;
+		if(skip > header_new-offset)
+			return 0;
+		offset += skip;
+		if(length > (size_t)(end-pos) || length > header_new-offset)
+			return 0;
+		if(!apply(target, offset, pos, length))
+			return 0;
+		pos += length;
+		offset += length;
+	}
+	*new_length = header_new;
+	return 1;
+}
+
+int apply_nothing(void *target, size_t offset, const unsigned char *data, size_t length)
+{
+	(void)target; (void)offset; (void)data; (void)length;
+	return 1;
+}
+
+int apply_to_buffer(void *target, size_t offset, const unsigned char *data, size_t length)
+{
+	memcpy((unsigned char*)target + offset, data, length);
+	return 1;
+}
+
+int apply_to_file(void *target, size_t offset, const unsigned char *data, size_t length)
+{
+	int fd = *(int*)target;
+	while(length > 0)
+	{
+		ssize_t written = pwrite(fd, data, length, offset);
+		if(written <= 0)
+			return 0;
+		data += written;
+		offset += written;
+		length -= written;
+	}
+	return 1;
+}
+
+// Apply #patch to the map in #map, in place. #capacity must be at least the
+// new length. Return 1 on success, with the new length in *length; on
+// failure the map is left alone.
+int map_patch(unsigned char *map, size_t capacity, size_t *length,
+              const unsigned char *patch, size_t patch_length)
+{
+	const unsigned char *pos = patch+4, *end = patch+patch_length;
+	uint64_t header_old, header_new;
+	
+	if(patch_length < 4 || !patch_get_varint(&pos, end, &header_old)
+	 || !patch_get_varint(&pos, end, &header_new) || header_new > capacity)
+		return 0;
+	if(!map_patch_walk(patch, patch_length, *length, &header_new, apply_nothing, NULL))
+		return 0;
+	return map_patch_walk(patch, patch_length, *length, length, apply_to_buffer, map);
+}
+
+// Apply #patch to the open file #fd, in place: only the changed runs are
+// written, and the file is truncated if the new map is shorter. The patch is
+// checked before anything is written, so a bad one leaves the file alone.
+int map_patch_fd(int fd, const unsigned char *patch, size_t patch_length)
+{
+	struct stat st;
+	size_t new_length;
+	
+	if(fstat(fd, &st) < 0)
+		return 0;
+	if(!map_patch_walk(patch, patch_length, st.st_size, &new_length, apply_nothing, NULL))
+		return 0;
+	if(!map_patch_walk(patch, patch_length, st.st_size, &new_length, apply_to_file, &fd))
+		return 0;
+	if(new_length < (size_t)st.st_size && ftruncate(fd, new_length) < 0)
+		return 0;
+	return 1;
+}
+
+
+
+// Map a whole file into memory read-only. Return NULL if it can't be read.
+const unsigned char *map_file(const char *filename, size_t *length)
+{
+	struct stat st;
+	void *data;
+	int fd = open(filename, O_RDONLY);
+	
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	*length = st.st_size;
+	if(*length == 0) {
+		close(fd);
+		return (const unsigned char*)"";
+	}
+	data = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return data==MAP_FAILED ? NULL : (const unsigned char*)data;
+}
+
+int main(int argc, char **argv)
+{
+	const unsigned char *old_map, *new_map, *patch;
+	unsigned char *out;
+	size_t old_length, new_length, patch_length;
+	FILE *fout;
+	int fd;
+	
+	if(argc == 5 && !strcmp(argv[1], "diff"))
+	{
+		old_map = map_file(argv[2], &old_length);
+		new_map = map_file(argv[3], &new_length);
+		if(!old_map || !new_map) {
+			fprintf(stderr, "Could not read input files.\n");
+			return 1;
+		}
+		patch_length = map_diff(old_map, old_length, new_map, new_length, &out);
+		
+		fout = fopen(argv[4], "wb");
+		if(!fout || fwrite(out, patch_length, 1, fout) != 1) {
+			fprintf(stderr, "Could not write patch file.\n");
+			return 1;
+		}
+		fclose(fout);
+		free(out);
+		return 0;
+	}
+	else if(argc == 4 && !strcmp(argv[1], "apply"))
+	{
+		patch = map_file(argv[3], &patch_length);
+		if(!patch) {
+			fprintf(stderr, "Could not read patch file.\n");
+			return 1;
+		}
+		fd = open(argv[2], O_RDWR);
+		if(fd < 0) {
+			fprintf(stderr, "Could not open map file.\n");
+			return 1;
+		}
+		if(!map_patch_fd(fd, patch, patch_length)) {
+			fprintf(stderr, "Patch does not apply to %s.\n", argv[2]);
+			return 1;
+		}
+		close(fd);
+		return 0;
+	}
+	
+	fprintf(stderr, "Usage: %s diff oldmap newmap patchfile\n"
+	                "       %s apply map patchfile\n", argv[0], argv[0]);
+	return 1;
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2026 The Random Cave Tutorials contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ *
+ */
+/*
+ * Hardware performance counters for the benchmarks in Cave.c and
+ * digger3.cpp, which include this file directly, so each still builds
+ * from its one source file.
+ *
+ * The counters are read as one perf_event group so they all cover the same
+ * stretch of code. Only user-mode events are counted. If the kernel doesn't
+ * allow them (no PMU, a VM, or perf_event_paranoid set too high), none
+ * open and the benchmarks report times only.
+ *
+ * Every read is a system call, which costs far more than the counters
+ * themselves and disturbs the caches, so reading them around something that
+ * takes only a few hundred nanoseconds mostly measures the reading.
+ */
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define NUM_COUNTERS 6
+
+static const char *counter_names[NUM_COUNTERS] = {
+	"cycles", "instrs", "L1d-miss", "LLC-miss", "br-miss", "dTLB-miss"
+};
+static int counter_fd[NUM_COUNTERS];
+static int counter_slot[NUM_COUNTERS];   // Position in the group's read, or -1
+static int counters_open;
+
+static inline void open_counters(void)
+{
+	static const uint64_t configs[NUM_COUNTERS][2] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ<<8
+		                      | PERF_COUNT_HW_CACHE_RESULT_MISS<<16 },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+		{ PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ<<8
+		                      | PERF_COUNT_HW_CACHE_RESULT_MISS<<16 },
+	};
+	int ii, leader = -1;
+	
+	for(ii=0; ii<NUM_COUNTERS; ii++)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = configs[ii][0];
+		attr.config = configs[ii][1];
+		attr.disabled = leader < 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		
+		counter_fd[ii] = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+		counter_slot[ii] = counter_fd[ii] < 0 ? -1 : counters_open++;
+		if(leader < 0 && counter_fd[ii] >= 0)
+			leader = counter_fd[ii];
+	}
+	if(leader >= 0) {
+		ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+}
+
+// Read every counter into #values; counters that aren't available read 0.
+static inline void read_counters(uint64_t values[NUM_COUNTERS])
+{
+	uint64_t buf[NUM_COUNTERS+1] = {0};
+	int ii, leader = -1;
+	
+	for(ii=0; ii<NUM_COUNTERS && leader<0; ii++)
+		leader = counter_fd[ii];
+	if(leader >= 0 && read(leader, buf, sizeof(buf)) < (ssize_t)sizeof(uint64_t))
+		buf[0] = 0;
+	for(ii=0; ii<NUM_COUNTERS; ii++)
+		values[ii] = counter_slot[ii] >= 0 && counter_slot[ii] < (int)buf[0] ? buf[1+counter_slot[ii]] : 0;
+}
+
+#endif